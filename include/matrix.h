@@ -1,10 +1,17 @@
 #ifndef _MATRIX_H_
 #define _MATRIX_H_
 
+#include <stddef.h>
+
+struct mtrx_arena;
+typedef struct mtrx_arena* MtrxArena;
+
 struct matrix {
     int ROWS;
     int COLS;
     double* vals;
+    MtrxArena arena; //The arena holding the matrix, or NULL if it is on the heap.
+    int view; //Nonzero if vals belongs to some other owner.
 };
 
 typedef struct matrix* Matrix;
@@ -13,6 +20,33 @@ Matrix makeMatrix(int r, int c);
 Matrix cloneMatrix(Matrix A);
 void freeMatrix(Matrix m);
 
+/**
+ * Views are matrices whose values live in storage owned by something else,
+ * such as a network's parameter buffer. freeMatrix leaves views alone; only
+ * the owner, which knows the storage is going away, calls freeMtrxView to
+ * release the header.
+ */
+Matrix makeMtrxView(int r, int c, double *vals);
+void freeMtrxView(Matrix view);
+
+/**
+ * An arena is a scoped region for matrix temporaries. While an arena is
+ * current on a thread, makeMatrix and every allocating matrix operation on
+ * that thread take their memory from it by bumping a pointer, freeMatrix on
+ * those matrices does nothing, and clearMtrxArena releases all of them at
+ * once. Each thread has its own current arena, so threads never contend.
+ *
+ * Matrices that must outlive the scope, such as layer weights, should be
+ * allocated while no arena is current.
+ */
+MtrxArena makeMtrxArena(size_t size);
+void freeMtrxArena(MtrxArena arena);
+void clearMtrxArena(MtrxArena arena);
+
+/* Makes arena (or the heap, if NULL) current on this thread. Returns the previous one. */
+MtrxArena useMtrxArena(MtrxArena arena);
+MtrxArena getMtrxArena();
+
 Matrix identityMatrix(int n);
 
 Matrix addMtrx(Matrix a, Matrix b);
@@ -20,9 +54,46 @@ Matrix subMtrx(Matrix a, Matrix b);
 Matrix mulMtrxM(Matrix a, Matrix b);
 Matrix mulMtrxC(Matrix m, double d);
 
+/* Products with one operand read transposed, without building the transpose. */
+Matrix mulMtrxTM(Matrix a, Matrix b); // a^T * b
+Matrix mulMtrxMT(Matrix a, Matrix b); // a * b^T
+
 Matrix hadamardProduct(Matrix a, Matrix b);
 
 Matrix transpose(Matrix a);
+
+/*
+ * Destination-passing variants of the operations above. Each writes its
+ * result into dst, which must already have the result's dimensions, and
+ * returns dst. Elementwise variants allow dst to alias a or b; the product
+ * and transpose variants do not.
+ */
+Matrix copyMtrxInto(Matrix dst, Matrix src);
+Matrix addMtrxInto(Matrix dst, Matrix a, Matrix b);
+Matrix subMtrxInto(Matrix dst, Matrix a, Matrix b);
+Matrix mulMtrxCInto(Matrix dst, Matrix m, double d);
+Matrix mulMtrxMInto(Matrix dst, Matrix a, Matrix b);
+Matrix hadamardProductInto(Matrix dst, Matrix a, Matrix b);
+Matrix transposeInto(Matrix dst, Matrix a);
+
+/* In-place updates. */
+void scaleMtrx(Matrix m, double d); // m = d * m
+void axpyMtrx(Matrix y, double alpha, Matrix x); // y = alpha * x + y
+void gemmMtrx(double alpha, Matrix a, Matrix b, double beta, Matrix c); // c = alpha * a * b + beta * c
+
+/* Transpose flags for gemmMtrxT. */
+#define MTRX_NO_TRANS 0
+#define MTRX_TRANS 1
+
+/* c = alpha * op(a) * op(b) + beta * c, where op transposes its operand if its flag is set. */
+void gemmMtrxT(int transA, int transB, double alpha, Matrix a, Matrix b, double beta, Matrix c);
+
+/**
+ * Rank-one update a = alpha * x * y_t + beta * a for column vectors x and y,
+ * in place and in one pass over a. Wider x and y fall back to gemmMtrxT.
+ */
+void gerMtrx(double alpha, Matrix x, Matrix y, double beta, Matrix a);
+
 int gaussian(Matrix A);
 int rowEchelon(Matrix A);
 
@@ -34,6 +105,7 @@ void setMtrxVal(Matrix m, int r, int c, double val);
 
 Matrix getRowVector(Matrix A, int r);
 Matrix getColVector(Matrix A, int r);
+void setColVector(Matrix A, int c, Matrix col);
 void addMtrxRow(Matrix A, int r, Matrix row);
 void mulMtrxRow(Matrix A, int r, double c);
 void swapMtrxRows(Matrix A, int i, int j);
@@ -41,5 +113,84 @@ void swapMtrxRows(Matrix A, int i, int j);
 void printMatrix(Matrix m);
 void printVector(Matrix v);
 
+/**
+ * A sparse matrix in compressed sparse row (CSR) form: the nonzeros of row r
+ * are vals[rowPtr[r]] through vals[rowPtr[r+1] - 1], in columns colIdx[...].
+ */
+struct sparse_matrix {
+    int ROWS;
+    int COLS;
+    int nnz;
+    int *rowPtr;
+    int *colIdx;
+    double *vals;
+};
+
+typedef struct sparse_matrix* SparseMatrix;
+
+SparseMatrix makeSparseMatrix(Matrix A); //Keeps only the nonzero entries of A.
+void freeSparseMatrix(SparseMatrix S);
+Matrix sparseToDense(SparseMatrix S);
+
+/* Sparse-dense product a * b; a matrix-vector product when b has one column. */
+Matrix mulSparseM(SparseMatrix a, Matrix b);
+Matrix mulSparseMInto(Matrix dst, SparseMatrix a, Matrix b);
+
+/**
+ * A sparse column vector of index/value pairs: entry idx[k] is vals[k], for
+ * k below nnz, and every other entry is zero. Suits one-hot and other
+ * categorical inputs with a handful of active features.
+ */
+struct sparse_vector {
+    int ROWS;
+    int nnz;
+    int *idx;
+    double *vals;
+};
+
+typedef struct sparse_vector* SparseVector;
+
+/**
+ * Copies nnz index/value pairs; a NULL vals makes every given entry 1.
+ * Returns NULL if an index is outside [0, rows).
+ */
+SparseVector makeSparseVector(int rows, int nnz, const int *idx, const double *vals);
+void freeSparseVector(SparseVector v);
+Matrix sparseVecToDense(SparseVector v);
+
+/* y = alpha * a * x + beta * y, gathering only the columns of a that x selects. */
+void gemvSparseMtrx(double alpha, Matrix a, SparseVector x, double beta, Matrix y);
+
+/**
+ * Rank-one update a = alpha * x * y_t + beta * a for a column vector x. When
+ * beta is 1, only the columns of a that y selects are touched.
+ */
+void gerSparseMtrx(double alpha, Matrix x, SparseVector y, double beta, Matrix a);
+
+/**
+ * Computes C = alpha * A * B + beta * C on raw row-major buffers, where A is
+ * m x k, B is k x n and C is m x n. Element (i, j) of A is read from
+ * A[i * rsA + j * csA], and likewise for B, so either operand may be read
+ * transposed by swapping its strides. When beta is zero, C is not read.
+ *
+ * Large products are cache-blocked and run through a vectorized register-tiled
+ * kernel; small ones (including matrix-vector products) use plain loops.
+ */
+void gemm(int m, int n, int k, double alpha,
+          const double *A, int rsA, int csA,
+          const double *B, int rsB, int csB,
+          double beta, double *C, int ldc);
+
+/**
+ * Returns the index of the largest entry of A * x + b without storing the
+ * product, where A is m x k with rows lda apart and b may be NULL. Ties go
+ * to the first index; -1 is returned if m is 0.
+ */
+int gemvArgmax(int m, int k, const double *A, int lda, const double *x, const double *b);
+
+/* Computes A = alpha * x * y_t + beta * A on a raw m x n row-major buffer. */
+void ger(int m, int n, double alpha, const double *x, const double *y,
+         double beta, double *A, int lda);
+
 #endif
 
@@ -12,9 +12,24 @@ struct nettrainkit {
     double momentum; // A constant that allows some of a previous change to be applied.
     double decay;
     int maxCycles;
+    int batchSize; // Samples per weight update in backpropagation; 1 or less updates after every sample.
+    int threads; // Worker threads for backpropagation and batch SOM; 1 or less trains on the calling thread.
+    int hogwild; // If set, backpropagation on sparse inputs updates the shared weights without synchronizing.
+    SparseVector *sparseInputs; // If set, the single-layer rules and backpropagation read sample i's input from here instead of data[i][0].
+    int somCols; // Width of the neuron grid in batch SOM training; 0 or less lays the neurons out in a line.
 };
 typedef struct nettrainkit* NetTrainKit;
 
+/**
+ * Fills a kit with defaults: no functions, derivatives or data, zero rates
+ * and cycles, one sample per update on one thread, no sparse inputs, and a
+ * SOM laid out in a line. Set the fields a rule uses afterwards.
+ */
+void initNetTrainKit(NetTrainKit kit);
+
+/* Allocates a kit and fills it with the defaults of initNetTrainKit. */
+NetTrainKit makeNetTrainKit();
+
 /**
  * Defines a function template for training Neural Nets.
 
@@ -26,7 +41,9 @@ typedef void (*NetTrainRule)(NeuralNet, NetTrainKit);
 /**
  * Applies the supervised version of the Hebbian rule to a Neural Net to train. 
  * This method modifies the intensity of connections between active inputs and
- * active outputs in order to categorize inputs.
+ * active outputs in order to categorize inputs. Decay is kept in the
+ * layer's weight scale, so each sample only touches the rows of its
+ * active outputs.
  *
  * precondition: The given Neural Network should only have one layer.
  */
@@ -34,6 +51,27 @@ void supervisedHebbRuleTrain(NeuralNet net, NetTrainKit kit);
 
 void deltaRuleTrain(NeuralNet net, NetTrainKit kit);
 
+/**
+ * Trains a multi-layer Neural Net with backpropagation. With a batch size
+ * greater than one, each batch of samples is propagated as one matrix, one
+ * column per sample, and the weights receive a single update averaged over
+ * the batch. Batches require derivatives that return Jacobian diagonals.
+ *
+ * With more than one thread, the data is sharded across the threads. By
+ * default each thread computes the gradient of its share of every batch,
+ * and the gradients are summed before the update, so updates match those
+ * of one thread at the same batch size; threads beyond the batch size sit
+ * idle. If no thread can be started, training runs on the calling thread.
+ *
+ * With sparseInputs set, samples are trained one at a time from their
+ * sparse inputs, and only the active columns of the first layer's weights
+ * are read, stepped and decayed; their momentum is kept per column and only
+ * advances when the column is active. In Hogwild mode the threads then take
+ * samples in turn from a shared counter and update the shared weights
+ * without locking. Without Hogwild, sparse inputs train on the calling
+ * thread. Hogwild needs sparse inputs, since a dense update rewrites every
+ * weight; without them it falls back to the synchronous mode.
+ */
 void backpropagationTrain(NeuralNet net, NetTrainKit kit);
 
 /**
@@ -52,9 +90,23 @@ void unsupervisedHebbRuleTrain(NeuralNet net, NetTrainKit kit);
 /**
  * Uses the Kohonen competitive training rule to train a Neural
  * Network. This rule is unsupervised and therefore does not
- * require training outputs.
+ * require training outputs. For each input, the neuron with the
+ * largest net input wins (see netWinner) and its weights move
+ * toward the input by the learning rate; the other neurons' weights
+ * only decay, which costs O(1) through the layer's weight scale.
  */
 void kohonenTrain(NeuralNet net, NetTrainKit kit);
 
+/**
+ * Trains a one-layer Neural Network as a self-organizing map, with the
+ * neurons (rows of W) laid out on a grid somCols wide. Each epoch finds the
+ * nearest neuron to every sample, split across the kit's threads, then moves
+ * every neuron at once to the mean of the samples won around it, weighted by
+ * a Gaussian neighborhood on the grid. The neighborhood radius shrinks from
+ * half the grid to half a cell over maxCycles epochs. The learning rate and
+ * the layer's bias are not used.
+ */
+void batchSomTrain(NeuralNet net, NetTrainKit kit);
+
 #endif
 
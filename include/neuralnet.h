@@ -9,15 +9,67 @@
 
 typedef Matrix (*TransFunc)(Matrix);
 
+/*
+ * The gradients below are for elementwise functions, so their Jacobians are
+ * diagonal. They return only the diagonal, in the same shape as the input,
+ * and training applies them as a Hadamard product. A gradient that returns
+ * a square n x n matrix for an n x 1 input is used as a full Jacobian.
+ */
+
 Matrix linearTransfer(Matrix m); // f(X) = X
 Matrix linearTransferGradient(Matrix m); // d/dX X = 1
 
 Matrix sigmoidTransfer(Matrix m); // f(X) = 1 / (1 + e^(-X))
 Matrix sigmoidTransferGradient(Matrix m); // d/dX f = f (1 - f)
 
+/*
+ * A faster sigmoid for inference, interpolated from a table. It is within
+ * 1.2e-5 of sigmoidTransfer everywhere, and a NaN stays NaN. Train with
+ * sigmoidTransferGradient.
+ */
+Matrix fastSigmoidTransfer(Matrix m);
+
 Matrix unitStepTransfer(Matrix m); //f(x) = x >= 0 ? 1 : 0
 Matrix competeTransfer(Matrix m); //f(x) = v | v_i = v_i >= v_j forall j ? 1 : 0
-Matrix zeroMatrix(Matrix m); //d/dx c = o
+Matrix zeroMatrix(Matrix m); //d/dx c = 0
+
+/*
+ * In-place versions of the transfer functions, which overwrite their
+ * argument with the result instead of allocating a new matrix.
+ * getInPlaceTransfer maps a TransFunc to its in-place version, or to NULL
+ * if it has none.
+ */
+typedef void (*TransFuncInPlace)(Matrix);
+
+void linearTransferInPlace(Matrix m);
+void sigmoidTransferInPlace(Matrix m);
+void fastSigmoidTransferInPlace(Matrix m);
+void unitStepTransferInPlace(Matrix m);
+void competeTransferInPlace(Matrix m);
+
+TransFuncInPlace getInPlaceTransfer(TransFunc f);
+
+/*
+ * Gradients computed from a function's output y = f(x) instead of its input,
+ * which saves evaluating f again. They scale the errors d in place by the
+ * Jacobian diagonal. getOutputGradient returns the one that matches the
+ * gradient g of f, or NULL if g has to be evaluated on the input.
+ */
+typedef void (*TransGradFromOutput)(Matrix d, Matrix y);
+
+void linearGradientFromOutput(Matrix d, Matrix y); // d
+void sigmoidGradientFromOutput(Matrix d, Matrix y); // d * y (1 - y)
+
+TransGradFromOutput getOutputGradient(TransFunc f, TransFunc g);
+
+/*
+ * Stable IDs for the built-in transfer functions, as stored in model files.
+ * NULL has ID 0, and functions without an ID map to -1.
+ */
+#define TRANSFER_ID_MAX 5
+
+int getTransferId(TransFunc f);
+TransFunc getTransferById(int id);
 
 struct neuron_layer;
 
@@ -28,13 +80,59 @@ NeuronLayer makeBlankNeuronLayer(int in, int out, TransFunc func);
 NeuronLayer maleBlankRecurrentLayer(int in, int out, int r, TransFunc func);
 NeuronLayer makePresetNeuronLayer(Matrix W, Matrix R, int r, TransFunc func);
 
+/**
+ * Makes a convolutional layer over a rows x cols grid of cells, where each
+ * cell has inCh input channels and outCh output channels. Input and output
+ * vectors hold the grid row by row with each cell's channels adjacent. The
+ * layer stores only the shared outCh x (inCh * k * k) kernel; column
+ * (dy * k + dx) * inCh + c weighs channel c of the neighbor at offset
+ * (dy - k/2, dx - k/2), and neighbors past the edge of the grid are zero.
+ * With k = 1 the layer applies the same small dense layer to every cell.
+ *
+ * Convolutional layers run in netFunction, batches and plans; the training
+ * rules only handle dense layers.
+ */
+NeuronLayer makeConvNeuronLayer(int rows, int cols, int inCh, int outCh, int k, TransFunc func);
+
 void freeNeuronLayer(NeuronLayer layer);
 
 /* Getters for NeuronLayer */
 Matrix getLayerWeights(NeuronLayer layer);
 Matrix getLayerRecurrentWeights(NeuronLayer layer);
+Matrix getLayerBias(NeuronLayer layer); //NULL if the layer has no bias
 int getLayerRecurrence(NeuronLayer layer);
 TransFunc getLayerFunc(NeuronLayer layer);
+int getLayerKernel(NeuronLayer layer); //0 for dense layers
+int getLayerInputSize(NeuronLayer layer);
+int getLayerOutputSize(NeuronLayer layer);
+
+/**
+ * A layer's weights carry a scale factor that is applied lazily, so that
+ * decaying them is O(1). getLayerScaledWeights returns the stored weights
+ * along with the scale they are multiplied by, and foldLayerScale writes
+ * the scale into them. The scale stays pending across training calls, so
+ * that one-sample updates stay O(nnz); running the network honors it.
+ * getLayerWeights and getNetWeights return the stored weights without it,
+ * so call foldLayerScale before reading or writing them directly after
+ * Hebbian or Kohonen training. getNetParams, packNetParams, saveNeuralNet
+ * and backpropagation fold for you.
+ */
+Matrix getLayerScaledWeights(NeuronLayer layer, double *scale);
+void foldLayerScale(NeuronLayer layer);
+
+/**
+ * Multiplies a layer's weights by d in O(1). The product is only written
+ * to the stored weights when the scale grows too large or small to keep.
+ */
+void scaleLayerWeights(NeuronLayer layer, double d);
+
+/**
+ * W = beta * W + alpha * y * x_t for a layer's weights W, where y and x
+ * are column vectors. beta goes to the lazy scale, so only the rows of W
+ * where y is nonzero are touched.
+ */
+void updateLayerWeights(NeuronLayer layer, double alpha, Matrix y, Matrix x, double beta);
+void updateLayerWeightsSparse(NeuronLayer layer, double alpha, Matrix y, SparseVector x, double beta);
 
 /* Setter methods */
 void setLayerWeights(NeuronLayer layer, Matrix m);
@@ -42,12 +140,58 @@ void setLayerRecurrentWeights(NeuronLayer layer, Matrix r);
 void setLayerRecurrence(NeuronLayer layer, int r);
 void setLayerFunc(NeuronLayer layer, TransFunc func);
 
-/* Runs a single layer, assuming it is not recurrent. */
+/**
+ * Gives a layer a bias, an out x 1 matrix added to its product before the
+ * transfer function (out is the number of output channels for a
+ * convolutional layer), or removes it when b is NULL. The layer takes
+ * ownership of b. Layers start without a bias; backpropagation trains
+ * biases along with the weights.
+ */
+void setLayerBias(NeuronLayer layer, Matrix b);
+
+/**
+ * Marks a dense layer as sparse, so that it runs from a CSR copy of its
+ * weights, or back to dense. Returns -1 for convolutional layers, which
+ * cannot be sparse. If more than a third of the weights are nonzero, the
+ * copy would be slower than the dense product, so the layer stays marked
+ * but runs dense. setLayerWeights refreshes the copy, but changes made to
+ * the weights in place, as training does, need another call to
+ * setLayerSparse before they are seen. The mark is saved with the model.
+ *
+ * On a loaded or built network this only saves compute time: the dense
+ * weights stay allocated, as training and the parameter buffer use them,
+ * so the copy adds memory. mapNeuralNet hands the pages of a sparse layer's
+ * dense weights back after making the copy, so a mapped network holds only
+ * the copy in memory until something reads the dense weights.
+ */
+int setLayerSparse(NeuronLayer layer, int sparse);
+int isLayerSparse(NeuronLayer layer);
+
+/**
+ * Runs a single layer, assuming it is not recurrent. The output starts as
+ * the bias and the product is accumulated onto it, and the transfer
+ * function then runs over it in place when it can.
+ */
 Matrix layerFunction(NeuronLayer layer, Matrix x);
 
 /* Runs a single layer, allowing it to be recurrent. */
 Matrix* layerRecurrentFunction(NeuronLayer layer, Matrix *x);
-Matrix layerRaw(NeuronLayer layer, Matrix x);
+Matrix layerRaw(NeuronLayer layer, Matrix x); //W x + b, before the transfer function
+
+/**
+ * Returns the index of the largest entry of W x + b for a single input x,
+ * which is the winner of a competitive layer. Dense layers compute it in
+ * one pass without allocating. netWinner runs the layers before the last
+ * normally and returns the winner of the last one.
+ */
+int layerWinner(NeuronLayer layer, Matrix x);
+
+/**
+ * Runs a single layer on a sparse input vector. For a dense layer, the
+ * product only gathers the columns of W that x selects.
+ */
+Matrix layerSparseFunction(NeuronLayer layer, SparseVector x);
+Matrix layerSparseRaw(NeuronLayer layer, SparseVector x);
 
 /******************/
 /* NEURAL NETWORK */ 
@@ -58,6 +202,7 @@ typedef struct neural_net* NeuralNet;
 
 /* Neural Net factory */
 NeuralNet makeNeuralNet(int sizes[]);
+NeuralNet makeNeuralNetFromLayers(NeuronLayer layers[]); //NULL-terminated; the net takes ownership.
 void freeNeuralNet(NeuralNet net);
 
 /* Getter methods */
@@ -65,12 +210,87 @@ NeuronLayer getNetLayer(NeuralNet net, int layer);
 Matrix getNetWeights(NeuralNet net, int layer);
 int getNetDepth(NeuralNet net);
 
+/**
+ * A network keeps all of its layers' weights, including recurrent weights
+ * and biases, in one contiguous, 64-byte aligned parameter buffer, and each layer's
+ * matrices are views into it, in layer order. Setting a layer's weights to
+ * a matrix of the same shape copies it into the buffer; a different shape
+ * detaches that layer until packNetParams is called again, which also picks
+ * up recurrent weights and biases attached after the network was made.
+ */
+void packNetParams(NeuralNet net);
+double* getNetParams(NeuralNet net);
+size_t getNetParamCount(NeuralNet net);
+
 /* Runs network on an input Matrix */
 Matrix netFunction(NeuralNet net, Matrix x);
 
+/**
+ * Runs the network on a batch of inputs, given as the columns of an
+ * in x N matrix, and returns the out x N matrix of outputs. Each layer
+ * runs as a single matrix-matrix product over the whole batch.
+ */
+Matrix netBatchFunction(NeuralNet net, Matrix X);
+
 /* Runs a recurrent network on a set of input matrices. */
 Matrix* netRecurrentFunction(NeuralNet net, Matrix *xs);
 
+int netWinner(NeuralNet net, Matrix x);
+
+/**
+ * netFunction and netWinner for a sparse input; only the first layer sees
+ * it. For a single dense or CSR layer, netSparseWinner sums each output
+ * from the active columns and allocates nothing.
+ */
+Matrix netSparseFunction(NeuralNet net, SparseVector x);
+int netSparseWinner(NeuralNet net, SparseVector x);
+
+/**
+ * Model files store a network's layer shapes, transfer function IDs,
+ * recurrence, weights and biases in a versioned binary format. The weights are the
+ * network's parameter buffer verbatim, starting on a 64-byte boundary, so
+ * mapNeuralNet can use them straight from a read-only shared mapping of the
+ * file without parsing. A mapped network is for inference only: writing to
+ * its weights faults, until packNetParams copies them to the heap.
+ *
+ * Files are in the host's byte order. Saving fails (returning -1) if a
+ * layer has a transfer function without an ID or was detached from the
+ * parameter buffer; loading and mapping return NULL on any error. Files
+ * of the first version, which had no biases, load with none.
+ */
+int saveNeuralNet(NeuralNet net, const char *path);
+NeuralNet loadNeuralNet(const char *path);
+NeuralNet mapNeuralNet(const char *path);
+
+/******************/
+/* INFERENCE PLAN */
+/******************/
+
+/**
+ * A plan runs a network's forward pass with no allocations. Compiling walks
+ * the network once and sizes two activation buffers to its widest layer for
+ * up to cols inputs at a time; each layer then writes its product into one
+ * buffer and applies its transfer function there in place. Layers whose
+ * transfer function has no in-place version fall back to allocating.
+ *
+ * The plan reads the layer weights and transfer functions on every run, so
+ * training the network in place or changing its functions is fine, but
+ * changing its shape requires a new plan.
+ */
+struct net_plan;
+typedef struct net_plan* NetPlan;
+
+NetPlan compileNeuralNet(NeuralNet net, int cols);
+void freeNetPlan(NetPlan plan);
+
+/**
+ * Runs the plan on x, which may have up to the compiled number of columns.
+ * The result lives in the plan's buffers: it is valid until the next run,
+ * and must not be freed. Returns NULL if x has too many columns or does not
+ * have the network's input size.
+ */
+Matrix runNetPlan(NetPlan plan, Matrix x);
+
 #endif
 
 
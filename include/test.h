@@ -2,10 +2,23 @@
 #define _TEST_H_
 
 void backpropXorDemo();
+
+/**
+ * Trains the XOR network of backpropXorDemo in Hogwild mode on two threads
+ * and prints whether it converged.
+ */
+void hogwildXorDemo();
+
 void hebbianXODemo();
 void deltaOrGateDemo();
 void hebbianBananaDemo();
 
+/**
+ * Compares fastSigmoidTransfer with sigmoidTransfer: prints the largest
+ * difference between them and the time each takes per value.
+ */
+void fastSigmoidDemo();
+
 /**
  * Runs Conway's Game of Life
  * 
@@ -13,8 +26,57 @@ void hebbianBananaDemo();
  *          Can be used for custom rules.
  */
 NeuralNet makeConwayNet(NeuralNet filter, int r, int c);
+
+/**
+ * When conwayCacheDir is set (it is NULL by default), the trained filter is
+ * cached there under a name hashed from its training configuration, training
+ * set and conwaySeed, so later runs load it instead of training again.
+ * Setting conwaySeed to 0 (seed from the clock), or training with a function
+ * that has no stable ID, always trains.
+ */
+extern unsigned int conwaySeed;
+extern const char *conwayCacheDir;
+
 NeuralNet makeConway(NeuralNet filter, int r, int c);
-void playConway(NeuralNet cwNet, int cycles, int r, int c, int *board);
+
+/* How playConway steps the board; see the benchmarks below for each. */
+#define CONWAY_FULL 0
+#define CONWAY_TILED 1
+#define CONWAY_INCREMENTAL 2
+
+/**
+ * Plays a game of Conway's Game of Life, printing every generation and
+ * waiting a second between them. CONWAY_FULL runs the whole board through
+ * cwNet each generation, CONWAY_TILED steps it in tiles on one thread per
+ * processor, and CONWAY_INCREMENTAL only steps the cells around those that
+ * changed. All three print the same generations.
+ */
+void playConway(NeuralNet cwNet, int cycles, int r, int c, int *board, int mode);
+
+/**
+ * Runs a game of Conway's Game of Life headlessly as fast as possible and
+ * prints the generations and cells computed per second. The final board is
+ * written back to board, and is also printed if render is set.
+ *
+ * Returns the number of generations per second.
+ */
+double benchConway(NeuralNet cwNet, int cycles, int r, int c, int *board, int render);
+
+/**
+ * Like benchConway, but splits the board into tile x tile squares that are
+ * stepped in parallel on the given number of threads. Each tile is run with
+ * a one-cell halo through a network sized for the tile, so cwNet may have
+ * been built for any board size. A tile of 0 picks a default.
+ */
+double benchConwayTiled(NeuralNet cwNet, int cycles, int r, int c, int *board,
+                        int render, int tile, int threads);
+
+/**
+ * Like benchConway, but only steps the cells next to cells that changed in
+ * the previous generation, falling back to stepping the whole board when
+ * too much of it is active. cwNet must be built for an r x c board.
+ */
+double benchConwayIncremental(NeuralNet cwNet, int cycles, int r, int c, int *board, int render);
 
 /**
  * Runs a game of rock paper scissors between a user and a Neural Net.
@@ -11,83 +11,152 @@
 #include <time.h>
 
 #include <unistd.h>
+#include <pthread.h>
 
 NetTrainKit kit = NULL;
 
 int conwaySizes[] = {1, 2, 3, 1, 0};
 
-NeuralNet makeConwayNet(NeuralNet filter, int r, int c) {
-    
-    int depth = getNetDepth(filter);
-    int sizes[depth + 3];
-    sizes[depth+2] = 0;
+//Seed for the filter's starting weights. Zero seeds from the clock instead,
+//which also bypasses the filter cache.
+unsigned int conwaySeed = 1;
 
-    int i = depth;
-    while (i--) {
-        sizes[i+2] = r * c * getNetWeights(filter, i)->ROWS;
+//Directory that trained filters are cached in, or NULL (the default) to always train.
+const char *conwayCacheDir = NULL;
+
+static void hashConway(unsigned long long *h, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    while (size--) {
+        *h ^= *bytes++;
+        *h *= 1099511628211ULL;
     }
-    sizes[1] = r * c * getNetWeights(filter, 0)->COLS;
-    sizes[0] = r * c;
+}
 
-    NeuralNet network = makeNeuralNet(sizes);
-    
-    setLayerFunc(getNetLayer(network, 0), linearTransfer);
+/* Gradients that can be named in the cache hash, after the transfer IDs. */
+static const TransFunc conwayGradients[] = {
+    linearTransferGradient,
+    sigmoidTransferGradient,
+    zeroMatrix
+};
+
+/* Returns a stable ID for a transfer function or gradient, or -1 if it has none. */
+static int conwayFuncId(TransFunc f) {
+    int id = getTransferId(f);
+    if (id >= 0)
+        return id;
+
+    int i = sizeof(conwayGradients) / sizeof(conwayGradients[0]);
+    while (i--)
+        if (conwayGradients[i] == f)
+            return TRANSFER_ID_MAX + 1 + i;
+
+    return -1;
+}
 
-    i = 2;
-    while (sizes[i]) {
-        setLayerFunc(getNetLayer(network, i-1), getLayerFunc(getNetLayer(filter, i-2)));
+/**
+ * Names the cache file for the current training configuration. Every setting
+ * that changes the trained weights goes into the name's hash, including the
+ * training set. Returns -1 if a function in the kit has no stable ID, as
+ * such a configuration cannot be told apart from others.
+ */
+static int conwayCachePath(char *path, size_t size) {
+    unsigned long long h = 14695981039346656037ULL;
+
+    int i = 0;
+    while (conwaySizes[i]) {
+        hashConway(&h, &conwaySizes[i], sizeof(int));
         i++;
     }
 
-    int x = r;
-    while (x--) {
-        int y = c;
-        while (y--) {
-            //Apply input at (x, y)
-            int i = x * c + y; //Index of (x,y)
-            
-            //The first layer adds the neighbors and livelihood for each cell
-            //printf("Building custom filter for (%i, %i)...\n", x, y);
-            int j = -1;
-            while (j <= 1) {
-                int k = -1;
-                while (k <= 1) {
-                    int l = (j+x) * c + (k+y); //Index of other cell
-                    if (j+x < 0 || j+x >= r || k+y < 0 || k+y >= c) {
-                        k++;
-                        continue;
-                    }
-
-                    if (j != 0 || k != 0)
-                        setMtrxVal(getNetWeights(network, 0), 2*i+1, l, 1); //Adding neighbors
-                    else
-                        setMtrxVal(getNetWeights(network, 0), 2*i, l, 1); //Is cell living
-                    k++;
-                }
-                j++;
-            }
-            
-            //printf("Building layer filters...\n");
-
-            j = getNetDepth(filter);
-            while (j--) {
-                Matrix M = getNetWeights(filter, j);
-                int k = M->ROWS;
-                while (k--) {
-                    int m = M->COLS;
-                    while (m--) {
-                        setMtrxVal(getNetWeights(network, j+1),
-                                    i * M->ROWS + k,
-                                    i * M->COLS + m,
-                                    getMtrxVal(M, k, m));
-                    }
-                }
-            }
+    i = 2;
+    while (i--) {
+        int id = conwayFuncId(kit->functions[i]);
+        int gradId = conwayFuncId(kit->derivatives[i]);
+        if (id < 0 || gradId < 0)
+            return -1;
+        hashConway(&h, &id, sizeof(int));
+        hashConway(&h, &gradId, sizeof(int));
+    }
 
+    i = 0;
+    while (kit->data[i]) {
+        int j = 2;
+        while (j--) {
+            Matrix m = kit->data[i][j];
+            hashConway(&h, &m->ROWS, sizeof(int));
+            hashConway(&h, &m->COLS, sizeof(int));
+            hashConway(&h, m->vals, m->ROWS * m->COLS * sizeof(double));
         }
+        i++;
     }
 
-    return network;
+    hashConway(&h, &kit->learnRate, sizeof(double));
+    hashConway(&h, &kit->momentum, sizeof(double));
+    hashConway(&h, &kit->decay, sizeof(double));
+    hashConway(&h, &kit->maxCycles, sizeof(int));
+    hashConway(&h, &kit->batchSize, sizeof(int));
+    hashConway(&h, &kit->threads, sizeof(int));
+    hashConway(&h, &kit->hogwild, sizeof(int));
+    hashConway(&h, &conwaySeed, sizeof(unsigned int));
+
+    snprintf(path, size, "%s/conway-%016llx.nnet", conwayCacheDir, h);
+    return 0;
+}
+
+/**
+ * Copies a cached filter into network. Returns 0 on a hit, or -1 if there
+ * is no usable cached filter.
+ */
+static int loadConwayFilter(NeuralNet network, const char *path) {
+    NeuralNet cached = loadNeuralNet(path);
+    if (!cached)
+        return -1;
+
+    int depth = getNetDepth(network);
+    int hit = getNetDepth(cached) == depth;
+
+    int i = depth;
+    while (hit && i--) {
+        Matrix M = getNetWeights(network, i);
+        Matrix C = getNetWeights(cached, i);
+        hit = M->ROWS == C->ROWS && M->COLS == C->COLS;
+    }
+
+    i = depth;
+    while (hit && i--)
+        copyMtrxInto(getNetWeights(network, i), getNetWeights(cached, i));
+
+    freeNeuralNet(cached);
+    return hit ? 0 : -1;
+}
+
+NeuralNet makeConwayNet(NeuralNet filter, int r, int c) {
+    
+    int depth = getNetDepth(filter);
+    NeuronLayer layers[depth + 2];
+    layers[depth + 1] = NULL;
+
+    //The first layer adds the neighbors and livelihood for each cell
+    layers[0] = makeConvNeuronLayer(r, c, 1, getNetWeights(filter, 0)->COLS, 3, linearTransfer);
+    Matrix K = getLayerWeights(layers[0]);
+    int i = 9;
+    while (i--) {
+        if (i == 4)
+            setMtrxVal(K, 0, i, 1); //Is cell living
+        else
+            setMtrxVal(K, 1, i, 1); //Adding neighbors
+    }
+
+    //The remaining layers apply the filter to every cell on its own.
+    i = depth;
+    while (i--) {
+        Matrix M = getNetWeights(filter, i);
+        layers[i+1] = makeConvNeuronLayer(r, c, M->COLS, M->ROWS, 1,
+                                          getLayerFunc(getNetLayer(filter, i)));
+        copyMtrxInto(getLayerWeights(layers[i+1]), M);
+    }
+
+    return makeNeuralNetFromLayers(layers);
 }
 
 NeuralNet makeConwayFilter(NeuralNet filter) {
@@ -106,30 +175,12 @@ NeuralNet makeConwayFilter(NeuralNet filter) {
     /*printf("Making network...\n");*/
     NeuralNet network = filter ? filter : makeNeuralNet(sizes);
     
-    srand(time(NULL));
-    
-    /*printf("Randomizing network...\n");*/
-
-    int i = 0;
-    while (sizes[i+1]) {
-        Matrix M = getNetWeights(network, i);
-        int r = M->ROWS;
-        while(r--) {
-            int c = M->COLS;
-            while (c--) {
-                double d = ((double)rand()) / ((double) RAND_MAX);
-                setMtrxVal(M, r, c, 2 * d - 1);
-            }
-        }
-        i++;
-    }
-    
-    
+    int i;
     if (!kit) {
 
         /*printf("Building training kit...\n");*/
         
-        kit = (NetTrainKit) malloc(sizeof(struct nettrainkit));
+        kit = makeNetTrainKit();
 
         kit->functions = (TransFunc*) malloc(3 * sizeof(TransFunc));
         //kit->functions[0] = linearTransfer;
@@ -177,12 +228,39 @@ NeuralNet makeConwayFilter(NeuralNet filter) {
     setLayerFunc(getNetLayer(network, 1), kit->functions[1]);
     /*setLayerFunc(getNetLayer(network, 2), kit->functions[2]);*/
 
+    char path[4096];
+    int cached = conwaySeed && conwayCacheDir && !conwayCachePath(path, sizeof(path));
+    if (cached && !loadConwayFilter(network, path))
+        return network;
+
+    srand(conwaySeed ? conwaySeed : time(NULL));
+    
+    /*printf("Randomizing network...\n");*/
+
+    i = 0;
+    while (sizes[i+1]) {
+        Matrix M = getNetWeights(network, i);
+        int r = M->ROWS;
+        while(r--) {
+            int c = M->COLS;
+            while (c--) {
+                double d = ((double)rand()) / ((double) RAND_MAX);
+                setMtrxVal(M, r, c, 2 * d - 1);
+            }
+        }
+        i++;
+    }
+
     printf("Training network...\n");
 
     backpropagationTrain(network, kit);
     
     printf("Complete!\n");
 
+    //A cache that cannot be written only costs the next run a retrain.
+    if (cached)
+        saveNeuralNet(network, path);
+
     return network;
 }
 
@@ -198,36 +276,14 @@ NeuralNet makeConway(NeuralNet f, int r, int c) {
         Matrix x = kit->data[i][0];
         Matrix y = netFunction(filter, x);
 
-        int live = getMtrxVal(x, 0, 0) > 0;
-        int neighbors = getMtrxVal(x, 1, 0);
-/*
-        while (j < 9) {
-            if (j != 4 && getMtrxVal(x, j, 0) > 0)
-                living++;
-            j++;
-        }
-
-        printf("Input: {Live: %i, Nghbr: %i}\n", live, neighbors);
-        printf("Output: %i\n", getMtrxVal(y, 0, 0) > 0);
-        if (live) {
-            if ((neighbors == 2 || neighbors == 3) == (getMtrxVal(y, 0, 0) > 0))
-                printf("Right\n\n");
-            else
-                printf("Wrong (expected %i, got %lf)\n\n", (neighbors == 2 || neighbors == 3), getMtrxVal(y, 0, 0));
-        } else if ((neighbors == 3) == (getMtrxVal(y, 0, 0) > 0))
-            printf("Right\n\n");
-        else
-            printf("Wrong (expected %i, got %lf)\n\n", (neighbors == 3), getMtrxVal(y, 0, 0));
-
         Matrix err = subMtrx(y, kit->data[i][1]);
-        double dE = vecNorm(err);
-        error += dE;
-        freeMatrix(y);
+        error += vecNorm(err);
         freeMatrix(err);
+        freeMatrix(y);
     }
 
-    printf("The filter's error is %lf\n", error);
-*/    
+    //printf("The filter's error is %lf\n", error);
+    
     //Do not allow error.
     if (error < 0.5) {
         i = 0;
@@ -264,16 +320,8 @@ NeuralNet makeConway(NeuralNet f, int r, int c) {
 
 }
 
-void playConway(NeuralNet cwNet, int cycles, int r, int c, int *board) {
-    Matrix grid = makeMatrix(r * c, 1);
-
-    int i = r * c;
-    while (i--) {
-        //printf("%i, %i = %i\n", i/r, i%r, board[i]);
-        setMtrxVal(grid, i, 0, board[i]);
-    }
-
-    i = 0;
+static void printConwayBoard(Matrix grid, int r, int c) {
+    int i = 0;
     while (i < r * c) {
         if (getMtrxVal(grid, i, 0) > 0)
             printf("\033[31m\u25A0\033[0m");
@@ -283,36 +331,529 @@ void playConway(NeuralNet cwNet, int cycles, int r, int c, int *board) {
             printf("\n");
         i++;
     }
-     
+}
+
+double benchConway(NeuralNet cwNet, int cycles, int r, int c, int *board, int render) {
+    NetPlan plan = compileNeuralNet(cwNet, 1);
+    Matrix grid = makeMatrix(r * c, 1);
+
+    int i = r * c;
+    while (i--)
+        setMtrxVal(grid, i, 0, board[i]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    //The plan reuses its buffers, so each generation only copies the board back.
     int iter = cycles;
+    while (iter--)
+        copyMtrxInto(grid, runNetPlan(plan, grid));
 
-    while (iter) {
-        
-        //printf("\nGenning result...\n");
-        Matrix newGrid = netFunction(cwNet, grid);
-        //printf("Done.\n");
-        
-        printf("\n");
-        
-        sleep(1);
-        i = 0;
-        while (i < r * c) {
-            if (getMtrxVal(newGrid, i, 0) > 0)
-                printf("\033[31m\u25A0\033[0m");
-            else
-                printf("\u25A0");
-            if (i % c == c-1)
-                printf("\n");
-            i++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double rate = secs > 0 ? cycles / secs : 0;
+
+    i = r * c;
+    while (i--)
+        board[i] = getMtrxVal(grid, i, 0) > 0;
+
+    if (render)
+        printConwayBoard(grid, r, c);
+
+    printf("%i generations of %ix%i in %lf s: %lf gen/s, %lf cells/s\n",
+            cycles, r, c, secs, rate, rate * r * c);
+
+    freeMatrix(grid);
+    freeNetPlan(plan);
+
+    return rate;
+}
+
+/**********************/
+/* TILED CONWAY BOARD */
+/**********************/
+
+#define CONWAY_TILE 64
+
+/**
+ * Builds a copy of a Conway network for a different board size. The layers
+ * are convolutions, so only the grid changes and the kernels are copied.
+ */
+static NeuralNet resizeConwayNet(NeuralNet cwNet, int r, int c) {
+    int depth = getNetDepth(cwNet);
+    NeuronLayer layers[depth + 1];
+    layers[depth] = NULL;
+
+    int i = depth;
+    while (i--) {
+        NeuronLayer layer = getNetLayer(cwNet, i);
+        Matrix K = getLayerWeights(layer);
+        int k = getLayerKernel(layer);
+
+        layers[i] = makeConvNeuronLayer(r, c, K->COLS / (k * k), K->ROWS, k, getLayerFunc(layer));
+        copyMtrxInto(getLayerWeights(layers[i]), K);
+        if (getLayerBias(layer))
+            setLayerBias(layers[i], cloneMatrix(getLayerBias(layer)));
+    }
+
+    return makeNeuralNetFromLayers(layers);
+}
+
+struct conway_shared {
+    NeuralNet tileNet;
+    int tile;
+    int tilesR;
+    int tilesC;
+    int r;
+    int c;
+    int cycles;
+    int threads;
+
+    //Generations alternate between the two boards.
+    double *board[2];
+    pthread_barrier_t barrier;
+};
+
+struct conway_worker {
+    struct conway_shared *shared;
+    int id;
+    pthread_t thread;
+};
+
+/**
+ * Steps one tile from src into dst. The tile is read with a one-cell halo
+ * so the cells on its edge see all of their neighbors; cells off the board
+ * read as dead, as they do when the whole board is run at once.
+ */
+static void stepConwayTile(struct conway_shared *sh, NetPlan plan, Matrix in,
+                           int ty, int tx, const double *src, double *dst) {
+    int t = sh->tile;
+    int w = t + 2;
+    int y0 = ty * t;
+    int x0 = tx * t;
+
+    int y = w;
+    while (y--) {
+        int sy = y0 + y - 1;
+        int x = w;
+        while (x--) {
+            int sx = x0 + x - 1;
+            int live = sy >= 0 && sy < sh->r && sx >= 0 && sx < sh->c;
+            in->vals[y * w + x] = live ? src[sy * sh->c + sx] : 0;
         }
+    }
 
-        freeMatrix(grid);
-        grid = newGrid;
+    Matrix out = runNetPlan(plan, in);
 
-        iter--;
+    int rows = sh->r - y0 < t ? sh->r - y0 : t;
+    int cols = sh->c - x0 < t ? sh->c - x0 : t;
+    y = rows;
+    while (y--) {
+        int x = cols;
+        while (x--)
+            dst[(y0 + y) * sh->c + x0 + x] = out->vals[(y + 1) * w + x + 1];
+    }
+}
+
+static void* conwayWorker(void *arg) {
+    struct conway_worker *wk = (struct conway_worker*) arg;
+    struct conway_shared *sh = wk->shared;
+
+    int w = sh->tile + 2;
+    NetPlan plan = compileNeuralNet(sh->tileNet, 1);
+    Matrix in = makeMatrix(w * w, 1);
+
+    int tiles = sh->tilesR * sh->tilesC;
+    int gen = 0;
+    while (gen < sh->cycles) {
+        const double *src = sh->board[gen & 1];
+        double *dst = sh->board[~gen & 1];
+
+        //Tiles are dealt out round robin so every thread gets some of each row.
+        int i = wk->id;
+        while (i < tiles) {
+            stepConwayTile(sh, plan, in, i / sh->tilesC, i % sh->tilesC, src, dst);
+            i += sh->threads;
+        }
+
+        pthread_barrier_wait(&sh->barrier); //Generation done
+        gen++;
+    }
+
+    freeMatrix(in);
+    freeNetPlan(plan);
+    return NULL;
+}
+
+/* Sets up the tiles, boards and barrier for stepping board on a pool of threads. */
+static void initConwayTiles(struct conway_shared *sh, NeuralNet cwNet, int r, int c,
+                            int *board, int tile, int threads) {
+    sh->tile = tile > 0 ? tile : CONWAY_TILE;
+    sh->tilesR = (r + sh->tile - 1) / sh->tile;
+    sh->tilesC = (c + sh->tile - 1) / sh->tile;
+    sh->r = r;
+    sh->c = c;
+    sh->threads = threads > 1 ? threads : 1;
+    sh->tileNet = resizeConwayNet(cwNet, sh->tile + 2, sh->tile + 2);
+
+    sh->board[0] = (double*) malloc((size_t) r * c * sizeof(double));
+    sh->board[1] = (double*) malloc((size_t) r * c * sizeof(double));
+
+    long i = (long) r * c;
+    while (i--)
+        sh->board[0][i] = board[i] > 0;
+
+    pthread_barrier_init(&sh->barrier, NULL, sh->threads);
+}
+
+/* Steps the tiles for some generations, leaving the result in board[0]. */
+static void runConwayTiles(struct conway_shared *sh, int cycles) {
+    sh->cycles = cycles;
+
+    struct conway_worker workers[sh->threads];
+    int j = sh->threads;
+    while (j--) {
+        workers[j].shared = sh;
+        workers[j].id = j;
+    }
+
+    //The calling thread steps its share of the tiles as worker 0.
+    j = sh->threads;
+    while (--j)
+        pthread_create(&workers[j].thread, NULL, conwayWorker, &workers[j]);
+    conwayWorker(&workers[0]);
+    j = sh->threads;
+    while (--j)
+        pthread_join(workers[j].thread, NULL);
+
+    if (cycles & 1) {
+        double *tmp = sh->board[0];
+        sh->board[0] = sh->board[1];
+        sh->board[1] = tmp;
+    }
+}
+
+static void freeConwayTiles(struct conway_shared *sh) {
+    pthread_barrier_destroy(&sh->barrier);
+    free(sh->board[0]);
+    free(sh->board[1]);
+    freeNeuralNet(sh->tileNet);
+}
+
+double benchConwayTiled(NeuralNet cwNet, int cycles, int r, int c, int *board,
+                        int render, int tile, int threads) {
+    struct conway_shared sh;
+    initConwayTiles(&sh, cwNet, r, c, board, tile, threads);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    runConwayTiles(&sh, cycles);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double rate = secs > 0 ? cycles / secs : 0;
+
+    Matrix grid = makeMtrxView(r * c, 1, sh.board[0]);
+
+    long i = (long) r * c;
+    while (i--)
+        board[i] = grid->vals[i] > 0;
+
+    if (render)
+        printConwayBoard(grid, r, c);
+
+    printf("%i generations of %ix%i on %i threads in %lf s: %lf gen/s, %lf cells/s\n",
+            cycles, r, c, sh.threads, secs, rate, rate * r * c);
+
+    freeMtrxView(grid);
+    freeConwayTiles(&sh);
+
+    return rate;
+}
+
+/****************************/
+/* INCREMENTAL CONWAY BOARD */
+/****************************/
+
+//Patches evaluated per batch, and the share of the board above which a
+//generation is cheaper to recompute in full.
+#define CONWAY_BATCH 256
+#define CONWAY_ACTIVE_DIV 4
+
+/**
+ * Builds a dense network that steps a single cell from the k x k patch
+ * around it. This relies on the Conway layout: one k x k convolution
+ * followed only by 1 x 1 convolutions.
+ */
+static NeuralNet makeConwayCellNet(NeuralNet cwNet) {
+    int depth = getNetDepth(cwNet);
+    int sizes[depth + 2];
+    sizes[depth + 1] = 0;
+
+    sizes[0] = getNetWeights(cwNet, 0)->COLS;
+    int i = depth;
+    while (i--)
+        sizes[i+1] = getNetWeights(cwNet, i)->ROWS;
+
+    NeuralNet cell = makeNeuralNet(sizes);
+
+    //A convolution at one cell is a dense product with its kernel.
+    i = depth;
+    while (i--) {
+        NeuronLayer layer = getNetLayer(cwNet, i);
+        copyMtrxInto(getNetWeights(cell, i), getLayerWeights(layer));
+        setLayerFunc(getNetLayer(cell, i), getLayerFunc(layer));
+        if (getLayerBias(layer))
+            setLayerBias(getNetLayer(cell, i), cloneMatrix(getLayerBias(layer)));
+    }
+    packNetParams(cell);
 
+    return cell;
+}
+
+struct conway_active {
+    int r;
+    int c;
+    int k;
+    NetPlan full;
+    NeuralNet cellNet;
+    NetPlan cellPlan;
+
+    Matrix grid;
+    double *patches;
+    double *results;
+
+    //Cells that changed in the last generation, and cells to evaluate in
+    //this one. A cell is queued once per generation by stamping it.
+    int *changed;
+    int *queue;
+    int *stamp;
+    int numChanged;
+
+    int gen;
+    long evaluated;
+};
+
+static void initConwayActive(struct conway_active *st, NeuralNet cwNet, int r, int c, int *board) {
+    int n = r * c;
+    st->r = r;
+    st->c = c;
+    st->k = getLayerKernel(getNetLayer(cwNet, 0));
+
+    st->full = compileNeuralNet(cwNet, 1);
+    st->cellNet = makeConwayCellNet(cwNet);
+    st->cellPlan = compileNeuralNet(st->cellNet, CONWAY_BATCH);
+
+    st->grid = makeMatrix(n, 1);
+    st->patches = (double*) malloc(st->k * st->k * CONWAY_BATCH * sizeof(double));
+    st->results = (double*) malloc(n * sizeof(double));
+
+    st->changed = (int*) malloc(n * sizeof(int));
+    st->queue = (int*) malloc(n * sizeof(int));
+    st->stamp = (int*) malloc(n * sizeof(int));
+    st->numChanged = n;
+
+    int i = n;
+    while (i--) {
+        setMtrxVal(st->grid, i, 0, board[i] > 0);
+        st->changed[i] = i;
+        st->stamp[i] = -1;
     }
 
+    st->gen = 0;
+    st->evaluated = 0;
+}
 
+/* Steps st->grid one generation, evaluating only around the cells that changed. */
+static void stepConwayActive(struct conway_active *st) {
+    int r = st->r;
+    int c = st->c;
+    int n = r * c;
+    int k = st->k;
+    int h = k / 2;
+    Matrix grid = st->grid;
+    int *changed = st->changed;
+    int *queue = st->queue;
+    int *stamp = st->stamp;
+    int gen = st->gen++;
+
+    //Only the neighborhoods of changed cells can change next.
+    int numQueued = 0;
+    int i = 0;
+    while (i < st->numChanged && numQueued * CONWAY_ACTIVE_DIV <= n) {
+        int y = changed[i] / c;
+        int x = changed[i] % c;
+        int dy = -h;
+        while (dy <= h) {
+            int dx = -h;
+            while (dx <= h) {
+                int sy = y + dy;
+                int sx = x + dx;
+                if (sy >= 0 && sy < r && sx >= 0 && sx < c && stamp[sy * c + sx] != gen) {
+                    stamp[sy * c + sx] = gen;
+                    queue[numQueued++] = sy * c + sx;
+                }
+                dx++;
+            }
+            dy++;
+        }
+        i++;
+    }
+
+    st->numChanged = 0;
+
+    if (numQueued * CONWAY_ACTIVE_DIV > n) {
+        //Too busy to track: step the whole board and diff it.
+        Matrix next = runNetPlan(st->full, grid);
+        i = n;
+        while (i--) {
+            double d = next->vals[i] > 0;
+            if (d != grid->vals[i])
+                changed[st->numChanged++] = i;
+            grid->vals[i] = d;
+        }
+        st->evaluated += n;
+        return;
+    }
+
+    //Gather the queued patches as columns and step them in batches.
+    int q = 0;
+    while (q < numQueued) {
+        int cols = numQueued - q < CONWAY_BATCH ? numQueued - q : CONWAY_BATCH;
+        Matrix X = makeMtrxView(k * k, cols, st->patches);
+
+        int j = cols;
+        while (j--) {
+            int y = queue[q + j] / c;
+            int x = queue[q + j] % c;
+            int p = k * k;
+            while (p--) {
+                int sy = y + p / k - h;
+                int sx = x + p % k - h;
+                int live = sy >= 0 && sy < r && sx >= 0 && sx < c;
+                st->patches[p * cols + j] = live ? grid->vals[sy * c + sx] : 0;
+            }
+        }
+
+        Matrix Y = runNetPlan(st->cellPlan, X);
+        j = cols;
+        while (j--)
+            st->results[q + j] = Y->vals[j] > 0;
+
+        freeMtrxView(X);
+        q += cols;
+    }
+
+    //Write back only after every patch has read the old board.
+    q = numQueued;
+    while (q--) {
+        if (st->results[q] != grid->vals[queue[q]]) {
+            grid->vals[queue[q]] = st->results[q];
+            changed[st->numChanged++] = queue[q];
+        }
+    }
+
+    st->evaluated += numQueued;
 }
 
+static void freeConwayActive(struct conway_active *st) {
+    free(st->changed);
+    free(st->queue);
+    free(st->stamp);
+    free(st->results);
+    free(st->patches);
+    freeMatrix(st->grid);
+    freeNetPlan(st->cellPlan);
+    freeNeuralNet(st->cellNet);
+    freeNetPlan(st->full);
+}
+
+double benchConwayIncremental(NeuralNet cwNet, int cycles, int r, int c, int *board, int render) {
+    struct conway_active st;
+    initConwayActive(&st, cwNet, r, c, board);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int iter = cycles;
+    while (iter--)
+        stepConwayActive(&st);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double rate = secs > 0 ? cycles / secs : 0;
+
+    int i = r * c;
+    while (i--)
+        board[i] = st.grid->vals[i] > 0;
+
+    if (render)
+        printConwayBoard(st.grid, r, c);
+
+    printf("%i generations of %ix%i in %lf s: %lf gen/s, %lf cells/s, %lf cells evaluated/gen\n",
+            cycles, r, c, secs, rate, rate * r * c, cycles ? (double) st.evaluated / cycles : 0);
+
+    freeConwayActive(&st);
+
+    return rate;
+}
+
+/******************/
+/* PLAYING CONWAY */
+/******************/
+
+void playConway(NeuralNet cwNet, int cycles, int r, int c, int *board, int mode) {
+    struct conway_shared tiles;
+    struct conway_active active;
+    Matrix grid;
+
+    //Each mode keeps the current board where it can be printed between generations.
+    if (mode == CONWAY_TILED) {
+        long threads = sysconf(_SC_NPROCESSORS_ONLN);
+        initConwayTiles(&tiles, cwNet, r, c, board, 0, threads > 0 ? threads : 1);
+        grid = makeMtrxView(r * c, 1, tiles.board[0]);
+    } else if (mode == CONWAY_INCREMENTAL) {
+        initConwayActive(&active, cwNet, r, c, board);
+        grid = active.grid;
+    } else {
+        grid = makeMatrix(r * c, 1);
+        int i = r * c;
+        while (i--)
+            setMtrxVal(grid, i, 0, board[i]);
+    }
+
+    printConwayBoard(grid, r, c);
+
+    int iter = cycles;
+    while (iter) {
+        if (mode == CONWAY_TILED) {
+            runConwayTiles(&tiles, 1);
+            grid->vals = tiles.board[0];
+        } else if (mode == CONWAY_INCREMENTAL)
+            stepConwayActive(&active);
+        else {
+            Matrix newGrid = netFunction(cwNet, grid);
+            freeMatrix(grid);
+            grid = newGrid;
+        }
+
+        printf("\n");
+
+        sleep(1);
+        printConwayBoard(grid, r, c);
+
+        iter--;
+    }
+
+    if (mode == CONWAY_TILED) {
+        freeMtrxView(grid);
+        freeConwayTiles(&tiles);
+    } else if (mode == CONWAY_INCREMENTAL)
+        freeConwayActive(&active);
+    else
+        freeMatrix(grid);
+}
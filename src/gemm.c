@@ -0,0 +1,331 @@
+#include "matrix.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Doubles per SIMD register on the target. */
+#if defined(__AVX__)
+#define GEMM_VW 4
+#else
+#define GEMM_VW 2
+#endif
+
+/* Register tile computed by the micro-kernel: MR rows of two vectors each. */
+#define GEMM_MR 4
+#define GEMM_NR (2 * GEMM_VW)
+
+/* Cache blocks: an MC x KC panel of A stays in L2 while the KC x NR
+   slivers of B stream through L1. */
+#define GEMM_MC 128
+#define GEMM_KC 256
+#define GEMM_NC 4096
+
+/* Products with fewer multiply-adds than this skip packing entirely. */
+#define GEMM_SMALL (48 * 48 * 48)
+
+#if defined(__GNUC__)
+typedef double gemm_vec __attribute__((vector_size(GEMM_VW * sizeof(double))));
+#endif
+
+/**
+ * Copies an mc x kc block of A into MR-row panels, column by column,
+ * padding the last panel with zeros.
+ */
+static void packA(int mc, int kc, const double *A, int rs, int cs, double *dst) {
+    int i = 0;
+    while (i < mc) {
+        int mr = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+        int p = 0;
+        while (p < kc) {
+            int r = 0;
+            while (r < mr) {
+                dst[r] = A[(i + r) * rs + p * cs];
+                r++;
+            }
+            while (r < GEMM_MR)
+                dst[r++] = 0;
+            dst += GEMM_MR;
+            p++;
+        }
+        i += GEMM_MR;
+    }
+}
+
+/**
+ * Copies a kc x nc block of B into NR-column panels, row by row,
+ * padding the last panel with zeros.
+ */
+static void packB(int kc, int nc, const double *B, int rs, int cs, double *dst) {
+    int j = 0;
+    while (j < nc) {
+        int nr = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        int p = 0;
+        while (p < kc) {
+            int c = 0;
+            while (c < nr) {
+                dst[c] = B[p * rs + (j + c) * cs];
+                c++;
+            }
+            while (c < GEMM_NR)
+                dst[c++] = 0;
+            dst += GEMM_NR;
+            p++;
+        }
+        j += GEMM_NR;
+    }
+}
+
+/**
+ * Multiplies one packed A panel by one packed B panel and adds
+ * alpha times the MR x NR result into the mr x nr corner of C.
+ */
+static void microKernel(int kc, const double *a, const double *b, double alpha,
+                        double *C, int ldc, int mr, int nr) {
+    double acc[GEMM_MR][GEMM_NR];
+
+#if defined(__GNUC__)
+    gemm_vec c00 = {0}, c01 = {0}, c10 = {0}, c11 = {0},
+             c20 = {0}, c21 = {0}, c30 = {0}, c31 = {0};
+
+    int p = kc;
+    while (p--) {
+        gemm_vec b0, b1;
+        memcpy(&b0, b, sizeof(gemm_vec));
+        memcpy(&b1, b + GEMM_VW, sizeof(gemm_vec));
+
+        c00 += a[0] * b0; c01 += a[0] * b1;
+        c10 += a[1] * b0; c11 += a[1] * b1;
+        c20 += a[2] * b0; c21 += a[2] * b1;
+        c30 += a[3] * b0; c31 += a[3] * b1;
+
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    memcpy(&acc[0][0], &c00, sizeof(gemm_vec)); memcpy(&acc[0][GEMM_VW], &c01, sizeof(gemm_vec));
+    memcpy(&acc[1][0], &c10, sizeof(gemm_vec)); memcpy(&acc[1][GEMM_VW], &c11, sizeof(gemm_vec));
+    memcpy(&acc[2][0], &c20, sizeof(gemm_vec)); memcpy(&acc[2][GEMM_VW], &c21, sizeof(gemm_vec));
+    memcpy(&acc[3][0], &c30, sizeof(gemm_vec)); memcpy(&acc[3][GEMM_VW], &c31, sizeof(gemm_vec));
+#else
+    memset(acc, 0, sizeof(acc));
+
+    int p = kc;
+    while (p--) {
+        int r = GEMM_MR;
+        while (r--) {
+            int c = GEMM_NR;
+            while (c--)
+                acc[r][c] += a[r] * b[c];
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+#endif
+
+    int r = 0;
+    while (r < mr) {
+        int c = 0;
+        while (c < nr) {
+            C[r * ldc + c] += alpha * acc[r][c];
+            c++;
+        }
+        r++;
+    }
+}
+
+/* Plain loops for shapes where packing would cost more than it saves. */
+static void smallGemm(int m, int n, int k, double alpha,
+                      const double *A, int rsA, int csA,
+                      const double *B, int rsB, int csB,
+                      double *C, int ldc) {
+    int i = 0;
+    if (n == 1) {
+        //Matrix-vector product: one dot product per row of A.
+        while (i < m) {
+            double d = 0;
+            int p = 0;
+            while (p < k) {
+                d += A[i * rsA + p * csA] * B[p * rsB];
+                p++;
+            }
+            C[i * ldc] += alpha * d;
+            i++;
+        }
+        return;
+    }
+
+    while (i < m) {
+        int p = 0;
+        while (p < k) {
+            double a = alpha * A[i * rsA + p * csA];
+            const double *b = B + p * rsB;
+            double *c = C + i * ldc;
+            int j = 0;
+            while (j < n) {
+                c[j] += a * b[j * csB];
+                j++;
+            }
+            p++;
+        }
+        i++;
+    }
+}
+
+void gemm(int m, int n, int k, double alpha,
+          const double *A, int rsA, int csA,
+          const double *B, int rsB, int csB,
+          double beta, double *C, int ldc) {
+
+    //Apply beta up front so every block below can simply accumulate.
+    int i = m;
+    while (i--) {
+        double *c = C + i * ldc;
+        int j = n;
+        if (beta == 0)
+            while (j--) c[j] = 0;
+        else if (beta != 1)
+            while (j--) c[j] *= beta;
+    }
+
+    if (!m || !n || !k || alpha == 0)
+        return;
+
+    if ((double) m * n * k <= GEMM_SMALL || n == 1 || m < GEMM_MR) {
+        smallGemm(m, n, k, alpha, A, rsA, csA, B, rsB, csB, C, ldc);
+        return;
+    }
+
+    int mc = m < GEMM_MC ? m : GEMM_MC;
+    int kc = k < GEMM_KC ? k : GEMM_KC;
+    int nc = n < GEMM_NC ? n : GEMM_NC;
+
+    //Packed panels are rounded up to whole register tiles.
+    size_t aSize = ((mc + GEMM_MR - 1) / GEMM_MR) * GEMM_MR * kc * sizeof(double);
+    size_t bSize = ((nc + GEMM_NR - 1) / GEMM_NR) * GEMM_NR * kc * sizeof(double);
+    double *packedA = (double*) aligned_alloc(64, (aSize + 63) & ~(size_t) 63);
+    double *packedB = (double*) aligned_alloc(64, (bSize + 63) & ~(size_t) 63);
+
+    int jc = 0;
+    while (jc < n) {
+        int ncb = n - jc < nc ? n - jc : nc;
+
+        int pc = 0;
+        while (pc < k) {
+            int kcb = k - pc < kc ? k - pc : kc;
+            packB(kcb, ncb, B + pc * rsB + jc * csB, rsB, csB, packedB);
+
+            int ic = 0;
+            while (ic < m) {
+                int mcb = m - ic < mc ? m - ic : mc;
+                packA(mcb, kcb, A + ic * rsA + pc * csA, rsA, csA, packedA);
+
+                int jr = 0;
+                while (jr < ncb) {
+                    int nr = ncb - jr < GEMM_NR ? ncb - jr : GEMM_NR;
+                    int ir = 0;
+                    while (ir < mcb) {
+                        int mr = mcb - ir < GEMM_MR ? mcb - ir : GEMM_MR;
+                        microKernel(kcb,
+                                    packedA + ir * kcb,
+                                    packedB + jr * kcb,
+                                    alpha,
+                                    C + (ic + ir) * ldc + jc + jr, ldc,
+                                    mr, nr);
+                        ir += GEMM_MR;
+                    }
+                    jr += GEMM_NR;
+                }
+                ic += mc;
+            }
+            pc += kc;
+        }
+        jc += nc;
+    }
+
+    free(packedA);
+    free(packedB);
+}
+
+int gemvArgmax(int m, int k, const double *A, int lda, const double *x, const double *b) {
+    int best = -1;
+    double bestVal = 0;
+
+    int i = 0;
+    while (i < m) {
+        const double *a = A + (size_t) i * lda;
+        double d = b ? b[i] : 0;
+        int p = 0;
+
+#if defined(__GNUC__)
+        //Two vector accumulators keep the loads ahead of the adds.
+        gemm_vec s0 = {0}, s1 = {0};
+        while (p + 2 * GEMM_VW <= k) {
+            gemm_vec a0, a1, x0, x1;
+            memcpy(&a0, a + p, sizeof(gemm_vec));
+            memcpy(&a1, a + p + GEMM_VW, sizeof(gemm_vec));
+            memcpy(&x0, x + p, sizeof(gemm_vec));
+            memcpy(&x1, x + p + GEMM_VW, sizeof(gemm_vec));
+            s0 += a0 * x0;
+            s1 += a1 * x1;
+            p += 2 * GEMM_VW;
+        }
+        s0 += s1;
+
+        int l = GEMM_VW;
+        while (l--)
+            d += s0[l];
+#endif
+
+        while (p < k) {
+            d += a[p] * x[p];
+            p++;
+        }
+
+        //The first of equal maxima wins, as in competeTransfer.
+        if (best < 0 || d > bestVal) {
+            best = i;
+            bestVal = d;
+        }
+        i++;
+    }
+
+    return best;
+}
+
+void ger(int m, int n, double alpha, const double *x, const double *y,
+         double beta, double *A, int lda) {
+    int i = 0;
+    while (i < m) {
+        double *a = A + (size_t) i * lda;
+        double ax = alpha * x[i];
+        int j = 0;
+
+        //Rows with nothing to add only need the decay.
+        if (ax == 0) {
+            if (beta != 1)
+                while (j < n) {
+                    a[j] *= beta;
+                    j++;
+                }
+            i++;
+            continue;
+        }
+
+#if defined(__GNUC__)
+        while (j + GEMM_VW <= n) {
+            gemm_vec av, yv;
+            memcpy(&av, a + j, sizeof(gemm_vec));
+            memcpy(&yv, y + j, sizeof(gemm_vec));
+            av = beta * av + ax * yv;
+            memcpy(a + j, &av, sizeof(gemm_vec));
+            j += GEMM_VW;
+        }
+#endif
+
+        while (j < n) {
+            a[j] = beta * a[j] + ax * y[j];
+            j++;
+        }
+        i++;
+    }
+}
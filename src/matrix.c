@@ -4,13 +4,126 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-Matrix makeMatrix(int r, int c) {
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
+/* Arena memory is handed out in multiples of this many bytes. */
+#define ARENA_ALIGN 64
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char *mem;
+};
+
+struct mtrx_arena {
+    struct arena_block *blocks; //Most recent block first.
+    size_t total;
+};
+
+static _Thread_local MtrxArena currentArena = NULL;
+
+static struct arena_block* makeArenaBlock(size_t size, struct arena_block *next) {
+    struct arena_block *block = (struct arena_block*) malloc(sizeof(struct arena_block));
+    block->next = next;
+    block->size = ARENA_ROUND(size);
+    block->used = 0;
+    block->mem = (char*) aligned_alloc(ARENA_ALIGN, block->size);
+    return block;
+}
+
+static void* arenaAlloc(MtrxArena arena, size_t size) {
+    size = ARENA_ROUND(size);
+
+    struct arena_block *block = arena->blocks;
+    if (block->size - block->used < size) {
+        //Grow geometrically so a scope needs few blocks.
+        size_t next = block->size * 2 > size ? block->size * 2 : size;
+        block = arena->blocks = makeArenaBlock(next, block);
+        arena->total += block->size;
+    }
+
+    void *p = block->mem + block->used;
+    block->used += size;
+    return p;
+}
+
+MtrxArena makeMtrxArena(size_t size) {
+    MtrxArena arena = (MtrxArena) malloc(sizeof(struct mtrx_arena));
+    arena->blocks = makeArenaBlock(size ? size : 4096, NULL);
+    arena->total = arena->blocks->size;
+    return arena;
+}
+
+void freeMtrxArena(MtrxArena arena) {
+    if (!arena)
+        return;
+
+    if (currentArena == arena)
+        currentArena = NULL;
+
+    while (arena->blocks) {
+        struct arena_block *next = arena->blocks->next;
+        free(arena->blocks->mem);
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+    free(arena);
+}
+
+void clearMtrxArena(MtrxArena arena) {
+    if (arena->blocks->next) {
+        //The scope overflowed; replace the chain with one block that fits it all.
+        size_t total = arena->total;
+        while (arena->blocks) {
+            struct arena_block *next = arena->blocks->next;
+            free(arena->blocks->mem);
+            free(arena->blocks);
+            arena->blocks = next;
+        }
+        arena->blocks = makeArenaBlock(total, NULL);
+        arena->total = arena->blocks->size;
+    }
+
+    arena->blocks->used = 0;
+}
+
+MtrxArena useMtrxArena(MtrxArena arena) {
+    MtrxArena prev = currentArena;
+    currentArena = arena;
+    return prev;
+}
+
+MtrxArena getMtrxArena() {
+    return currentArena;
+}
+
+/**
+ * Allocates a matrix without initializing its values, from the current
+ * arena if there is one. Used by the operations below, which overwrite
+ * every entry anyway.
+ */
+static Matrix allocMatrix(int r, int c) {
+    Matrix m;
+
+    if (currentArena) {
+        m = (Matrix) arenaAlloc(currentArena, sizeof(struct matrix));
+        m->vals = (double*) arenaAlloc(currentArena, r * c * sizeof(double));
+        m->arena = currentArena;
+    } else {
+        m = (Matrix) malloc(sizeof(struct matrix));
+        m->vals = (double*) malloc(r * c * sizeof(double));
+        m->arena = NULL;
+    }
 
     m->ROWS = r;
     m->COLS = c;
+    m->view = 0;
 
-    m->vals = (double*) malloc(r * c * sizeof(double));
+    return m;
+}
+
+Matrix makeMatrix(int r, int c) {
+    Matrix m = allocMatrix(r, c);
 
     int i = r * c;
     while(i--)
@@ -21,13 +134,7 @@ Matrix makeMatrix(int r, int c) {
 }
 
 Matrix cloneMatrix(Matrix A) {
-    Matrix m = (Matrix) makeMatrix(A->ROWS, A->COLS);
-    int i = A->ROWS * A->COLS;
-    while(i--)
-        m->vals[i] = A->vals[i];
-    
-    return m;
-    
+    return copyMtrxInto(allocMatrix(A->ROWS, A->COLS), A);
 }
 
 Matrix identityMatrix(int n) {
@@ -41,8 +148,24 @@ Matrix identityMatrix(int n) {
     return I;
 }
 
+Matrix makeMtrxView(int r, int c, double *vals) {
+    Matrix m = (Matrix) malloc(sizeof(struct matrix));
+
+    m->ROWS = r;
+    m->COLS = c;
+    m->vals = vals;
+    m->arena = NULL;
+    m->view = 1;
+
+    return m;
+}
+
+void freeMtrxView(Matrix view) {
+    free(view);
+}
+
 void freeMatrix(Matrix m) {
-    if (!m)
+    if (!m || m->arena || m->view) //Arenas and owners release these themselves.
         return;
 
     int i = m->ROWS * m->COLS;
@@ -58,113 +181,146 @@ void freeMatrix(Matrix m) {
 }
 
 Matrix addMtrx(Matrix a, Matrix b) {
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
+    return addMtrxInto(allocMatrix(a->ROWS, a->COLS), a, b);
+}
 
-    m->ROWS = a->ROWS;
-    m->COLS = a->COLS;
+Matrix subMtrx(Matrix a, Matrix b) {
+    return subMtrxInto(allocMatrix(a->ROWS, a->COLS), a, b);
+}
 
-    m->vals = (double*) malloc(m->ROWS * m->COLS * sizeof(double*));
+Matrix mulMtrxC(Matrix a, double d) {
+    return mulMtrxCInto(allocMatrix(a->ROWS, a->COLS), a, d);
+}
 
-    int i = m->ROWS * m->COLS;
-    while(i--)
-        m->vals[i] = a->vals[i] + b->vals[i];
+Matrix mulMtrxM(Matrix a, Matrix b) {
+    if(!a || !b) //Error check
+        return NULL;
+    
+    return mulMtrxMInto(allocMatrix(a->ROWS, b->COLS), a, b);
+}
 
+Matrix mulMtrxTM(Matrix a, Matrix b) {
+    Matrix m = allocMatrix(a->COLS, b->COLS);
+    gemmMtrxT(MTRX_TRANS, MTRX_NO_TRANS, 1, a, b, 0, m);
     return m;
 }
 
-Matrix subMtrx(Matrix a, Matrix b) {
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
-    
-    m->ROWS = a->ROWS;
-    m->COLS = a->COLS;
+Matrix mulMtrxMT(Matrix a, Matrix b) {
+    Matrix m = allocMatrix(a->ROWS, b->ROWS);
+    gemmMtrxT(MTRX_NO_TRANS, MTRX_TRANS, 1, a, b, 0, m);
+    return m;
+}
+
+Matrix hadamardProduct(Matrix a, Matrix b) {
+    return hadamardProductInto(allocMatrix(a->ROWS, a->COLS), a, b);
+}
 
-    m->vals = (double*) malloc(m->ROWS * m->COLS * sizeof(double*));
+Matrix transpose(Matrix a) {
+    return transposeInto(allocMatrix(a->COLS, a->ROWS), a);
+}
 
-    int i = m->ROWS * m->COLS;
+Matrix copyMtrxInto(Matrix dst, Matrix src) {
+    int i = src->ROWS * src->COLS;
     while(i--)
-        m->vals[i] = a->vals[i] - b->vals[i];
+        dst->vals[i] = src->vals[i];
 
-    return m;
+    return dst;
 }
 
-Matrix mulMtrxC(Matrix a, double d) {
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
-
-    m->ROWS = a->ROWS;
-    m->COLS = a->COLS;
+Matrix addMtrxInto(Matrix dst, Matrix a, Matrix b) {
+    int i = a->ROWS * a->COLS;
+    while(i--)
+        dst->vals[i] = a->vals[i] + b->vals[i];
 
-    m->vals = (double*) malloc(m->ROWS * m->COLS * sizeof(double*));
+    return dst;
+}
 
-    int i = m->ROWS * m->COLS;
-    while(i--) {
-        m->vals[i] = a->vals[i] * d;
-    }
+Matrix subMtrxInto(Matrix dst, Matrix a, Matrix b) {
+    int i = a->ROWS * a->COLS;
+    while(i--)
+        dst->vals[i] = a->vals[i] - b->vals[i];
 
-    return m;
+    return dst;
 }
 
-Matrix mulMtrxM(Matrix a, Matrix b) {
-    if(!a || !b) //Error check
-        return NULL;
-    
-    if (a->COLS != b->ROWS) {
-        printf("Dangerous mult. btwn %i x %i and %i by %i matrices.\n", a->ROWS, a->COLS, b->ROWS, b->COLS);
-    }
+Matrix mulMtrxCInto(Matrix dst, Matrix a, double d) {
+    int i = a->ROWS * a->COLS;
+    while(i--)
+        dst->vals[i] = a->vals[i] * d;
 
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
+    return dst;
+}
 
-    m->ROWS = a->ROWS;
-    m->COLS = b->COLS;
+Matrix mulMtrxMInto(Matrix dst, Matrix a, Matrix b) {
+    gemmMtrx(1, a, b, 0, dst);
+    return dst;
+}
 
-    m->vals = (double*) malloc(m->ROWS * m->COLS * sizeof(double*));
+Matrix hadamardProductInto(Matrix dst, Matrix a, Matrix b) {
+    int i = a->ROWS * a->COLS;
+    while(i--)
+        dst->vals[i] = a->vals[i] * b->vals[i];
+
+    return dst;
+}
 
-    int i = m->ROWS;
+Matrix transposeInto(Matrix dst, Matrix a) {
+    int i = a->COLS;
     while(i--) {
-        int j = m->COLS;
-        while(j--) {
-            double d = 0;
-            int k = a->COLS;
-            while(k--)
-                d += getMtrxVal(a, i, k) * getMtrxVal(b, k, j);
-            setMtrxVal(m, i, j, d);
-        }
+        int j = a->ROWS;
+        while(j--)
+            dst->vals[i * a->ROWS + j] = a->vals[j * a->COLS + i];
     }
 
-    return m;
+    return dst;
 }
 
-Matrix hadamardProduct(Matrix a, Matrix b) {
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
-    
-    m->ROWS = a->ROWS;
-    m->COLS = a->COLS;
-
-    m->vals = (double*) malloc(m->ROWS * m->COLS * sizeof(double*));
-
+void scaleMtrx(Matrix m, double d) {
     int i = m->ROWS * m->COLS;
     while(i--)
-        m->vals[i] = a->vals[i] * b->vals[i];
+        m->vals[i] *= d;
+}
 
-    return m;
+void axpyMtrx(Matrix y, double alpha, Matrix x) {
+    int i = y->ROWS * y->COLS;
+    while(i--)
+        y->vals[i] += alpha * x->vals[i];
 }
 
-Matrix transpose(Matrix a) {
-    Matrix m = (Matrix) malloc(sizeof(struct matrix));
+void gemmMtrx(double alpha, Matrix a, Matrix b, double beta, Matrix c) {
+    gemmMtrxT(MTRX_NO_TRANS, MTRX_NO_TRANS, alpha, a, b, beta, c);
+}
 
-    m->ROWS = a->COLS;
-    m->COLS = a->ROWS;
+void gemmMtrxT(int transA, int transB, double alpha, Matrix a, Matrix b, double beta, Matrix c) {
+    //Dimensions of op(a) and op(b).
+    int m = transA ? a->COLS : a->ROWS;
+    int k = transA ? a->ROWS : a->COLS;
+    int kb = transB ? b->COLS : b->ROWS;
+    int n = transB ? b->ROWS : b->COLS;
 
-    m->vals = (double*) malloc(m->ROWS * m->COLS * sizeof(double*));
-    
-    int i = m->ROWS;
-    while(i--) {
-        int j = m->COLS;
-        while(j--)
-            setMtrxVal(m, i, j, getMtrxVal(a, j, i));
+    if (k != kb) {
+        printf("Dangerous mult. btwn %i x %i and %i by %i matrices.\n", m, k, kb, n);
     }
 
-    return m;
-   
+    //A transposed operand is just read with its strides swapped.
+    gemm(m, n, k, alpha,
+         a->vals, transA ? 1 : a->COLS, transA ? a->COLS : 1,
+         b->vals, transB ? 1 : b->COLS, transB ? b->COLS : 1,
+         beta, c->vals, c->COLS);
+}
+
+void gerMtrx(double alpha, Matrix x, Matrix y, double beta, Matrix a) {
+    if (x->COLS != 1 || y->COLS != 1) {
+        gemmMtrxT(MTRX_NO_TRANS, MTRX_TRANS, alpha, x, y, beta, a);
+        return;
+    }
+
+    if (x->ROWS != a->ROWS || y->ROWS != a->COLS) {
+        printf("Dangerous outer product of %i and %i vectors into %i x %i matrix.\n",
+               x->ROWS, y->ROWS, a->ROWS, a->COLS);
+    }
+
+    ger(a->ROWS, a->COLS, alpha, x->vals, y->vals, beta, a->vals, a->COLS);
 }
 
 int gaussian(Matrix A) {
@@ -276,6 +432,13 @@ Matrix getColVector(Matrix A, int c) {
     return col;
 }
 
+void setColVector(Matrix A, int c, Matrix col) {
+    int i = A->ROWS;
+    while(i--) {
+        A->vals[i * A->COLS + c] = col->vals[i];
+    }
+}
+
 void swapMtrxRows(Matrix A, int i, int j) {
     double d;
 
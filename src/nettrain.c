@@ -3,9 +3,33 @@
 #include "matrix.h"
 #include "neuralnet.h"
 
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 
+void initNetTrainKit(NetTrainKit kit) {
+    kit->functions = NULL;
+    kit->derivatives = NULL;
+    kit->data = NULL;
+    kit->learnRate = 0;
+    kit->momentum = 0;
+    kit->decay = 0;
+    kit->maxCycles = 0;
+    kit->batchSize = 1;
+    kit->threads = 1;
+    kit->hogwild = 0;
+    kit->sparseInputs = NULL;
+    kit->somCols = 0;
+}
+
+NetTrainKit makeNetTrainKit() {
+    NetTrainKit kit = (NetTrainKit) malloc(sizeof(struct nettrainkit));
+    initNetTrainKit(kit);
+    return kit;
+}
+
 /**
  * Computes the error of a Neural Net on given data.
  *
@@ -34,12 +58,25 @@ Matrix computeError(NeuralNet net, Matrix* data) {
 
 }
 
+/**
+ * Applies a transfer function gradient to a vector of errors. A gradient in
+ * the same shape as the errors is the diagonal of the Jacobian and scales
+ * them elementwise; anything else is a full Jacobian and multiplies them.
+ */
+static Matrix applyGradient(Matrix g, Matrix d) {
+    if (g->ROWS == d->ROWS && g->COLS == d->COLS)
+        return hadamardProduct(g, d);
+
+    return mulMtrxM(g, d);
+}
+
 void supervisedHebbRuleTrain(NeuralNet net, NetTrainKit kit) {
     
     int cycles = kit->maxCycles;
     Matrix **data = kit->data;
     
     double decay = kit->decay;
+    SparseVector *sparse = kit->sparseInputs;
 
     while (cycles) {
 
@@ -51,18 +88,11 @@ void supervisedHebbRuleTrain(NeuralNet net, NetTrainKit kit) {
             Matrix x = unit[0];
             Matrix y = unit[1];
 
-            Matrix x_t = transpose(x);
-            
-            //The change in weights is the product of y and x_t
-            Matrix dW = mulMtrxM(y, x_t);
-            freeMatrix(x_t);
-
-            //Applies the change
-            Matrix oldW = mulMtrxC(getNetWeights(net, 0), 1 - decay);
-            freeMatrix(getNetWeights(net, 0));
-            Matrix newW = addMtrx(dW, oldW);
-            freeMatrix(oldW);
-            setLayerWeights(getNetLayer(net, 0), newW);
+            //W = (1 - decay) * W + y * x_t, with the decay kept in the layer's scale.
+            if (sparse)
+                updateLayerWeightsSparse(getNetLayer(net, 0), 1, y, sparse[i], 1 - decay);
+            else
+                updateLayerWeights(getNetLayer(net, 0), 1, y, x, 1 - decay);
 
             i++;
         }
@@ -80,6 +110,10 @@ void deltaRuleTrain(NeuralNet net, NetTrainKit kit) {
     int cycles = kit->maxCycles;
     TransFunc transGrad = kit->derivatives ? kit->derivatives[0] : linearTransferGradient;
 
+    NeuronLayer layer = getNetLayer(net, 0);
+    TransGradFromOutput outGrad = getOutputGradient(getLayerFunc(layer), transGrad);
+    SparseVector *sparse = kit->sparseInputs;
+
     while (cycles) {
 
         int i = 0;
@@ -89,60 +123,469 @@ void deltaRuleTrain(NeuralNet net, NetTrainKit kit) {
             Matrix x = unit[0]; //Input for data point
             Matrix y = unit[1]; //Output for data point (expected)
 
-            Matrix z = netFunction(net, x); //Actual output on x
-
-            Matrix err = subMtrx(y, z); //The error in the particular case
+            //The net input is shared by the output and the gradient.
+            Matrix s = sparse ? layerSparseRaw(layer, sparse[i]) : layerRaw(layer, x);
+            Matrix z = getLayerFunc(layer)(s); //Actual output on x
+
+            //Compute Eg, the error in the particular case times the gradient.
+            Matrix d;
+            if (outGrad) {
+                d = subMtrxInto(s, y, z);
+                outGrad(d, z);
+            } else {
+                Matrix g = transGrad(s);
+                Matrix err = subMtrxInto(z, y, z);
+                d = applyGradient(g, err);
+                freeMatrix(g);
+                freeMatrix(s);
+            }
             freeMatrix(z);
-
-            Matrix d = mulMtrxC(err, rate);
-
-            //The gradient
-
-            Matrix tmp = layerRaw(getNetLayer(net, 0), x);
-            Matrix g = transGrad(tmp);
-            freeMatrix(tmp);
-            
-            //The transpose of the input
-            Matrix x_t = transpose(x);
-            
-            //Compute aEg
-            tmp = mulMtrxM(d, g);
-
-            d = mulMtrxM(err, x_t); //The change to M
-            
-            freeMatrix(x_t);
-            freeMatrix(tmp);
             
-            Matrix M = addMtrx(getNetWeights(net, 0), d); //The new M
-            freeMatrix(getNetWeights(net, 0));
-            setLayerWeights(getNetLayer(net, 0), M);
+            //Apply aEg * x_t to W in place.
+            if (sparse)
+                updateLayerWeightsSparse(layer, rate, d, sparse[i], 1);
+            else
+                updateLayerWeights(layer, rate, d, x, 1);
             
             freeMatrix(d);
             
-            freeMatrix(g);
-            freeMatrix(err);
-            
             i++;
         }
         
         cycles--;
 
     }
+
+}
+
+/**
+ * Backpropagation keeps a gradient for each layer's weights followed by one
+ * for each layer's bias, so these arrays have 2 * numLayers entries. The
+ * bias entries of layers without a bias are NULL.
+ */
+static Matrix backpropParam(NeuronLayer *layer, int numLayers, int j) {
+    if (j < numLayers)
+        return getLayerWeights(layer[j]);
+    return getLayerBias(layer[j - numLayers]);
+}
+
+/**
+ * Propagates the n samples starting at data[0] forward and backward through
+ * the layers, and accumulates G[j] = alpha * d * a_t + beta * G[j] for each
+ * layer, and G[numLayers + j] = alpha * d * 1 + beta * G[numLayers + j] for
+ * each bias. Temporaries are taken from the caller's current arena.
+ *
+ * If sx is given, it is the input of a single sample (n is 1) in place of
+ * data[0][0], and only its active columns of G[0] are accumulated.
+ */
+static void backpropBatch(NeuronLayer *layer, int numLayers, TransFunc *f, TransFunc *g,
+                          Matrix **data, int n, SparseVector sx, double alpha, double beta, Matrix *G) {
+
+    //Sums, outputs and needed derivatives.
+    Matrix a[numLayers];
+    Matrix s[numLayers];
+    Matrix d[numLayers];
+
+    //Layers whose gradient can be found from their outputs do not keep
+    //their sums; the transfer function overwrites them in place.
+    TransGradFromOutput og[numLayers];
+
+    Matrix *unit = data[0];
+
+    //The inputs and targets, one sample per column.
+    Matrix x = unit[0];
+    Matrix t = unit[1];
+    int j;
+
+    if (n > 1) {
+        x = makeMatrix(unit[0]->ROWS, n);
+        t = makeMatrix(unit[1]->ROWS, n);
+        j = n;
+        while (j--) {
+            setColVector(x, j, data[j][0]);
+            setColVector(t, j, data[j][1]);
+        }
+    }
+    
+    //Forward propagate the sums and outputs.
+    j = 0;
+    while (j < numLayers) {
+        if (!j && sx) {
+            //Only the active columns of the first layer are read.
+            s[j] = layerSparseRaw(layer[j], sx);
+        } else
+            s[j] = mulMtrxM(getLayerWeights(layer[j]), j ? a[j-1] : x);
+
+        Matrix b = !j && sx ? NULL : getLayerBias(layer[j]);
+        if (b) {
+            int r = s[j]->ROWS;
+            while (r--) {
+                int c = s[j]->COLS;
+                while (c--)
+                    s[j]->vals[r * s[j]->COLS + c] += b->vals[r];
+            }
+        }
+
+        TransFuncInPlace fi = getInPlaceTransfer(f[j]);
+        og[j] = fi ? getOutputGradient(f[j], g[j]) : NULL;
+        if (og[j]) {
+            fi(s[j]);
+            a[j] = s[j];
+            s[j] = NULL;
+        } else
+            a[j] = f[j](s[j]);
+        j++;
+    }
+    j--;
+    
+    //Error
+    Matrix dErr = subMtrx(a[j], t);
     
+    if (og[j]) {
+        og[j](dErr, a[j]);
+        d[j] = dErr;
+    } else {
+        Matrix grad = g[j](s[j]);
+        d[j] = applyGradient(grad, dErr);
+        freeMatrix(dErr);
+        freeMatrix(grad);
+    }
+
+    while (j--) {
+        Matrix tmp = mulMtrxTM(getLayerWeights(layer[j+1]), d[j+1]); //W_t * d
+        if (og[j]) {
+            og[j](tmp, a[j]);
+            d[j] = tmp;
+        } else {
+            Matrix grad = g[j](s[j]);
+            d[j] = applyGradient(grad, tmp);
+            freeMatrix(grad);
+            freeMatrix(tmp);
+        }
+    }
+    
+    j = numLayers;
+    while (j--) {
+        if (!j && sx) {
+            int r = G[j]->ROWS;
+            while (r--) {
+                double *row = G[j]->vals + (size_t) r * G[j]->COLS;
+                int k = sx->nnz;
+                while (k--)
+                    row[sx->idx[k]] = alpha * d[j]->vals[r] * sx->vals[k] + beta * row[sx->idx[k]];
+            }
+        } else
+            gemmMtrxT(MTRX_NO_TRANS, MTRX_TRANS, alpha, d[j], j ? a[j-1] : x, beta, G[j]);
+
+        //The bias sees an input of 1 in every sample.
+        Matrix GB = G[numLayers + j];
+        if (GB) {
+            int r = GB->ROWS;
+            while (r--) {
+                double sum = 0;
+                int c = d[j]->COLS;
+                while (c--)
+                    sum += d[j]->vals[r * d[j]->COLS + c];
+                GB->vals[r] = alpha * sum + beta * GB->vals[r];
+            }
+        }
+
+        freeMatrix(s[j]);
+        freeMatrix(a[j]);
+        freeMatrix(d[j]);
+    }
+}
+
+/**
+ * Applies decay and the step dW to every layer's weights, and the step to
+ * its bias, in place. If sx is given, only its active columns of the first
+ * layer's weights are decayed and stepped.
+ */
+static void backpropApply(NeuronLayer *layer, int numLayers, double decay, Matrix *dW, SparseVector sx) {
+    int j = 2 * numLayers;
+    while (j--) {
+        Matrix P = backpropParam(layer, numLayers, j);
+        if (!P)
+            continue;
+
+        if (!j && sx) {
+            int r = P->ROWS;
+            while (r--) {
+                double *row = P->vals + (size_t) r * P->COLS;
+                double *step = dW[j]->vals + (size_t) r * P->COLS;
+                int k = sx->nnz;
+                while (k--)
+                    row[sx->idx[k]] = (1 - decay) * row[sx->idx[k]] - step[sx->idx[k]];
+            }
+            continue;
+        }
+
+        if (j < numLayers)
+            scaleMtrx(P, 1 - decay);
+        axpyMtrx(P, -1, dW[j]);
+    }
+}
+
+/* State shared by the threads of a parallel backpropagation run. */
+struct backprop_shared {
+    NeuronLayer *layer;
+    int numLayers;
+    TransFunc *f;
+    TransFunc *g;
+    Matrix **data;
+    SparseVector *sparse;
+    int samples;
+    int threads;
+
+    double rate;
+    double momentum;
+    double decay;
+    int cycles;
+    int batch;
+
+    //The batch being computed in synchronous mode; a negative count stops the workers.
+    int first;
+    int count;
+    pthread_barrier_t barrier;
+
+    //The next sample to train on in Hogwild mode, counted across all cycles.
+    atomic_long next;
+
+    //Held while the workers start, so that they all see the final thread count.
+    pthread_mutex_t start;
+    int abort; //Set if the workers must return without training.
+};
+
+/* Waits until every worker has been started. Returns nonzero if training was called off. */
+static int backpropStarted(struct backprop_shared *sh) {
+    pthread_mutex_lock(&sh->start);
+    pthread_mutex_unlock(&sh->start);
+    return sh->abort;
+}
+
+struct backprop_worker {
+    struct backprop_shared *shared;
+    int id;
+    Matrix *G; //Gradient of this thread's shard, or its own momentum in Hogwild mode.
+    pthread_t thread;
+};
+
+/* Computes this worker's shard of the current batch into its G. */
+static void backpropShard(struct backprop_worker *w) {
+    struct backprop_shared *sh = w->shared;
+
+    int lo = sh->first + (int) ((long) sh->count * w->id / sh->threads);
+    int hi = sh->first + (int) ((long) sh->count * (w->id + 1) / sh->threads);
+
+    if (hi > lo) {
+        backpropBatch(sh->layer, sh->numLayers, sh->f, sh->g,
+                      &sh->data[lo], hi - lo, NULL, 1, 0, w->G);
+    } else {
+        int j = 2 * sh->numLayers;
+        while (j--)
+            if (w->G[j])
+                scaleMtrx(w->G[j], 0);
+    }
+}
+
+static void* backpropSyncWorker(void *arg) {
+    struct backprop_worker *w = (struct backprop_worker*) arg;
+    struct backprop_shared *sh = w->shared;
+
+    if (backpropStarted(sh))
+        return NULL;
+
+    MtrxArena arena = makeMtrxArena(0);
+    useMtrxArena(arena);
+
+    while (1) {
+        pthread_barrier_wait(&sh->barrier); //Batch posted
+        if (sh->count < 0)
+            break;
+
+        backpropShard(w);
+        clearMtrxArena(arena);
+
+        pthread_barrier_wait(&sh->barrier); //Shard done
+    }
+
+    useMtrxArena(NULL);
+    freeMtrxArena(arena);
+    return NULL;
+}
+
+/**
+ * Lock-free training on sparse inputs: the threads take samples one at a
+ * time from a shared cursor, so every thread sees all of the data in turn,
+ * and each writes its update to the shared weights without synchronization.
+ * Only the sample's active columns of the first layer are touched.
+ */
+static void* backpropHogwildWorker(void *arg) {
+    struct backprop_worker *w = (struct backprop_worker*) arg;
+    struct backprop_shared *sh = w->shared;
+
+    if (backpropStarted(sh))
+        return NULL;
+
+    MtrxArena arena = makeMtrxArena(0);
+    MtrxArena prevArena = useMtrxArena(arena);
+
+    long total = (long) sh->cycles * sh->samples;
+    long t;
+    while ((t = atomic_fetch_add(&sh->next, 1)) < total) {
+        int i = (int) (t % sh->samples);
+
+        backpropBatch(sh->layer, sh->numLayers, sh->f, sh->g, &sh->data[i], 1, sh->sparse[i],
+                      sh->rate * (1 - sh->momentum), sh->momentum, w->G);
+        backpropApply(sh->layer, sh->numLayers, sh->decay, w->G, sh->sparse[i]);
+
+        clearMtrxArena(arena);
+    }
+
+    useMtrxArena(prevArena);
+    freeMtrxArena(arena);
+    return NULL;
+}
+
+/**
+ * Runs backpropagation on kit->threads threads. Threads that fail to start
+ * are left out; if none can, -1 is returned before any training happens.
+ */
+static int parallelBackpropagationTrain(NeuronLayer *layer, int numLayers, NetTrainKit kit, Matrix *dW) {
+    struct backprop_shared sh;
+    sh.layer = layer;
+    sh.numLayers = numLayers;
+    sh.f = kit->functions;
+    sh.g = kit->derivatives;
+    sh.data = kit->data;
+    sh.sparse = kit->sparseInputs;
+    sh.samples = 0;
+    while (sh.data[sh.samples])
+        sh.samples++;
+    sh.threads = kit->threads;
+    sh.abort = 0;
+    atomic_init(&sh.next, 0);
+    pthread_mutex_init(&sh.start, NULL);
+
+    sh.rate = kit->learnRate;
+    sh.momentum = kit->momentum;
+    sh.decay = kit->decay;
+    sh.cycles = kit->maxCycles;
+    sh.batch = kit->batchSize > 1 ? kit->batchSize : 1;
+
+    //Every thread needs a gradient (or momentum) buffer of its own.
+    int threads = sh.threads;
+    struct backprop_worker workers[threads];
+    int i = threads;
+    while (i--) {
+        workers[i].shared = &sh;
+        workers[i].id = i;
+        workers[i].G = (Matrix*) malloc(2 * numLayers * sizeof(Matrix));
+
+        int j = 2 * numLayers;
+        while (j--) {
+            Matrix P = backpropParam(layer, numLayers, j);
+            workers[i].G[j] = P ? makeMatrix(P->ROWS, P->COLS) : NULL;
+        }
+    }
+
+    //Dense updates rewrite every weight, so only sparse inputs are trained lock-free.
+    int hogwild = kit->hogwild && sh.sparse;
+
+    //Workers are numbered from 0 in Hogwild mode; in synchronous mode the calling thread is worker 0.
+    int base = hogwild ? 0 : 1;
+    void* (*run)(void*) = hogwild ? backpropHogwildWorker : backpropSyncWorker;
+
+    pthread_mutex_lock(&sh.start);
+    i = base;
+    while (i < threads && !pthread_create(&workers[i].thread, NULL, run, &workers[i]))
+        i++;
+    int started = i - base;
+    sh.threads = i;
+    if (!sh.threads || (!hogwild && pthread_barrier_init(&sh.barrier, NULL, sh.threads)))
+        sh.abort = 1;
+    pthread_mutex_unlock(&sh.start);
+
+    if (hogwild || sh.abort) {
+        i = started;
+        while (i--)
+            pthread_join(workers[base + i].thread, NULL);
+    } else {
+        MtrxArena arena = makeMtrxArena(0);
+        MtrxArena prevArena = useMtrxArena(arena);
+
+        //Batches smaller than the thread count leave the surplus workers idle.
+        int batch = sh.batch;
+
+        int cycles = sh.cycles;
+        while (cycles--) {
+            sh.first = 0;
+            while (sh.first < sh.samples) {
+                sh.count = sh.samples - sh.first < batch ? sh.samples - sh.first : batch;
+
+                pthread_barrier_wait(&sh.barrier); //Batch posted
+                backpropShard(&workers[0]);
+                clearMtrxArena(arena);
+                pthread_barrier_wait(&sh.barrier); //Shard done
+
+                //Reduce the shards into the momentum step, then apply it.
+                double alpha = sh.rate * (1 - sh.momentum) / sh.count;
+                int j = 2 * numLayers;
+                while (j--) {
+                    if (!dW[j])
+                        continue;
+                    scaleMtrx(dW[j], sh.momentum);
+                    int k = sh.threads;
+                    while (k--)
+                        axpyMtrx(dW[j], alpha, workers[k].G[j]);
+                }
+                backpropApply(layer, numLayers, sh.decay, dW, NULL);
+
+                sh.first += sh.count;
+            }
+        }
+
+        sh.count = -1;
+        pthread_barrier_wait(&sh.barrier);
+        i = sh.threads;
+        while (--i)
+            pthread_join(workers[i].thread, NULL);
+        pthread_barrier_destroy(&sh.barrier);
+
+        useMtrxArena(prevArena);
+        freeMtrxArena(arena);
+    }
+
+    i = threads;
+    while (i--) {
+        int j = 2 * numLayers;
+        while (j--)
+            freeMatrix(workers[i].G[j]);
+        free(workers[i].G);
+    }
+    pthread_mutex_destroy(&sh.start);
+
+    return sh.abort ? -1 : 0;
 }
 
 void backpropagationTrain(NeuralNet net, NetTrainKit kit) {
     
-    Matrix **data = kit->data;
     if(!kit || !net) {
         //printf("Backpropagation training could not be performed.\n");
         return;
     }
+    Matrix **data = kit->data;
 
     double rate = kit->learnRate;
     double momentum = kit->momentum;
     double decay = kit->decay;
     int cycles = kit->maxCycles;
+    int batch = kit->batchSize > 1 ? kit->batchSize : 1;
+    SparseVector *sparse = kit->sparseInputs;
+
+    //Sparse inputs are trained one sample at a time.
+    if (sparse)
+        batch = 1;
 
     //Layer functions and their derivatives.
     TransFunc* f = kit->functions;
@@ -154,107 +597,56 @@ void backpropagationTrain(NeuralNet net, NetTrainKit kit) {
     //Layers.
     NeuronLayer layer[numLayers];
     int i = numLayers;
-    while (i--)
+    while (i--) {
         layer[i] = getNetLayer(net, i);
-    
-    //Sums and outputs.
-    Matrix a[numLayers];
-    Matrix s[numLayers];
 
-    //Needed derivatives.
-    Matrix d[numLayers];
-
-    //Holds the previous changes to the net weights
-    Matrix dW[numLayers];
-    i = numLayers;
+        //Workers read the weights directly, so any lazy scale goes in first.
+        foldLayerScale(layer[i]);
+    }
+    
+    //Holds the previous changes to the net weights and biases
+    Matrix dW[2 * numLayers];
+    i = 2 * numLayers;
     while (i--) {
-        Matrix W = getLayerWeights(layer[i]);
-        dW[i] = makeMatrix(W->ROWS, W->COLS);
+        Matrix P = backpropParam(layer, numLayers, i);
+        dW[i] = P ? makeMatrix(P->ROWS, P->COLS) : NULL;
     }
 
-    Matrix tmp;
-
-    while (cycles) {
-
-        i = 0;
-        while (data[i]) {
-            Matrix *unit = data[i];
-            
-            //The input vector.
-            Matrix x = unit[0];
-            Matrix t = unit[1];
-            int j;
-            
-            //Forward propagate the sums and outputs.
-            s[0] = mulMtrxM(getLayerWeights(layer[0]), x);
-            j = 0;
-            while (j < numLayers - 1) {
-                a[j] = f[j](s[j]);
-                s[j+1] = mulMtrxM(getLayerWeights(layer[j+1]), a[j]);
-                j++;
-            }
-            a[j] = f[j](s[j]);
-            
-            //Error
-            Matrix dErr = subMtrx(a[j], t);
-            
-            Matrix grad = g[j](s[j]);
-            
-            d[j] = mulMtrxM(grad, dErr);
-            
-            freeMatrix(dErr);
-            freeMatrix(grad);
-            while (j--) {
-                grad = g[j](s[j]);
-                Matrix W_t = transpose(getLayerWeights(layer[j+1]));
-                tmp = mulMtrxM(grad, W_t);
-                d[j] = mulMtrxM(tmp, d[j+1]);
-                
-                freeMatrix(grad);
-                freeMatrix(W_t);
-                freeMatrix(tmp);
-            }
-            
-            j = numLayers;
-            while (j--) {
-                Matrix a_t = transpose(j ? a[j-1] : x);
-                tmp = mulMtrxM(d[j], a_t);
-                freeMatrix(a_t);
-                
-                Matrix delta = mulMtrxC(tmp, rate); //-rate * dE/dW
-                freeMatrix(tmp);
-                
-                //Apply momentum
-                tmp = mulMtrxC(delta, 1 - momentum);
-                a_t = mulMtrxC(dW[j], momentum);
-                freeMatrix(delta);
-                freeMatrix(dW[j]);
-
-                dW[j] = addMtrx(tmp, a_t);
-                freeMatrix(tmp);
-                freeMatrix(a_t);
-            }
-
-            j = numLayers;
-            while (j--) {
-                Matrix W = getLayerWeights(layer[j]);
-                Matrix decW = mulMtrxC(W, 1 - decay);
-                freeMatrix(W);
-                setLayerWeights(layer[j], subMtrx(decW, dW[j]));
-
-                freeMatrix(s[j]);
-                freeMatrix(a[j]);
-                freeMatrix(d[j]);
-                freeMatrix(decW);
+    //Without threads to run on, training stays on the calling thread.
+    //Sparse inputs only run on threads in Hogwild mode.
+    if (kit->threads <= 1 || (sparse && !kit->hogwild)
+        || parallelBackpropagationTrain(layer, numLayers, kit, dW)) {
+        //Per-batch temporaries come from an arena that is cleared after each batch.
+        MtrxArena arena = makeMtrxArena(0);
+        MtrxArena prevArena = useMtrxArena(arena);
+
+        while (cycles) {
+
+            i = 0;
+            while (data[i]) {
+                //The number of samples in this batch.
+                int n = 0;
+                while (n < batch && data[i+n])
+                    n++;
+
+                //rate * d * a_t averaged over the batch, with momentum applied in the same pass.
+                SparseVector sx = sparse ? sparse[i] : NULL;
+                backpropBatch(layer, numLayers, f, g, &data[i], n, sx,
+                              rate * (1 - momentum) / n, momentum, dW);
+                backpropApply(layer, numLayers, decay, dW, sx);
+
+                clearMtrxArena(arena);
+                i += n;
             }
 
-            i++;
+            cycles--;
         }
 
-        cycles--;
+        useMtrxArena(prevArena);
+        freeMtrxArena(arena);
     }
 
-    i = numLayers;
+    i = 2 * numLayers;
     while (i--)
         freeMatrix(dW[i]);
 
@@ -266,6 +658,7 @@ void unsupervisedHebbRuleTrain(NeuralNet net, NetTrainKit kit) {
     Matrix **data = kit->data;
     
     double decay = kit->decay;
+    SparseVector *sparse = kit->sparseInputs;
 
     while (cycles) {
 
@@ -275,20 +668,14 @@ void unsupervisedHebbRuleTrain(NeuralNet net, NetTrainKit kit) {
 
             //Compute the output of the net on input x.
             Matrix x = unit[0];
-            Matrix y = netFunction(net, x);
+            Matrix y = sparse ? netSparseFunction(net, sparse[i]) : netFunction(net, x);
 
-            Matrix x_t = transpose(x);
-            
-            //The change in weights is the product of y and x_t
-            Matrix dW = mulMtrxM(y, x_t);
-            freeMatrix(x_t);
-
-            //Applies the change
-            Matrix oldW = mulMtrxC(getNetWeights(net, 0), 1 - decay);
-            freeMatrix(getNetWeights(net, 0));
-            Matrix newW = addMtrx(dW, oldW);
-            freeMatrix(oldW);
-            setLayerWeights(getNetLayer(net, 0), newW);
+            //W = (1 - decay) * W + y * x_t, with the decay kept in the layer's scale.
+            if (sparse)
+                updateLayerWeightsSparse(getNetLayer(net, 0), 1, y, sparse[i], 1 - decay);
+            else
+                updateLayerWeights(getNetLayer(net, 0), 1, y, x, 1 - decay);
+            freeMatrix(y);
 
             i++;
         }
@@ -305,7 +692,8 @@ void kohonenTrain(NeuralNet net, NetTrainKit kit) {
 
     double rate = kit->learnRate;
     double decay = kit->decay;
-    Matrix W = getNetWeights(net, 0);
+    NeuronLayer layer = getNetLayer(net, 0);
+    SparseVector *sparse = kit->sparseInputs;
 
     while (cycles) {
 
@@ -313,22 +701,38 @@ void kohonenTrain(NeuralNet net, NetTrainKit kit) {
         while(data[i]) {
             Matrix *unit = data[i];
 
-            //Compute the output of the net on input x.
+            //Only the winning neuron learns; it moves toward x.
             Matrix x = unit[0];
-            Matrix y = netFunction(net, x);
-
-            int j = y->ROWS;
-            while (getMtrxVal(y, j--, 0) <= 0);
-            freeMatrix(y);
-
+            int j = sparse ? netSparseWinner(net, sparse[i]) : netWinner(net, x);
+
+            //The losers decay through the layer's scale, which the winner's
+            //row is divided by in advance so that it does not decay.
+            double keep = decay < 1 ? 1 - decay : 1;
+            double s;
+            Matrix W = getLayerScaledWeights(layer, &s);
+            double *w = W->vals + j * W->COLS;
             int k = W->COLS;
-            while (k--) {
+            if (sparse) {
+                while (k--)
+                    w[k] *= (1 - rate) / keep;
+                k = sparse[i]->nnz;
+                while (k--)
+                    w[sparse[i]->idx[k]] += rate * sparse[i]->vals[k] / (s * keep);
+            } else {
+                while (k--)
+                    w[k] = ((1 - rate) * w[k] + rate * x->vals[k] / s) / keep;
+            }
+            scaleLayerWeights(layer, keep);
+
+            //Full decay zeroes the losers outright.
+            if (decay >= 1) {
                 int h = W->ROWS;
                 while (h--) {
-                    double w = h == j
-                               ? (1 - rate) * getMtrxVal(W, j, k) + rate
-                               : decay * getMtrxVal(W, j, k);
-                    setMtrxVal(W, h, k, w);
+                    if (h == j)
+                        continue;
+                    k = W->COLS;
+                    while (k--)
+                        W->vals[h * W->COLS + k] = 0;
                 }
             }
 
@@ -338,7 +742,195 @@ void kohonenTrain(NeuralNet net, NetTrainKit kit) {
         cycles--;
     }
 
+}
 
+/* Neighborhood radius, in grid cells, that batch SOM training shrinks to by its last epoch. */
+#define SOM_FINAL_RADIUS 0.5
+
+/* State shared by the threads of a batch SOM epoch. */
+struct som_shared {
+    Matrix W;
+    Matrix **data;
+    SparseVector *sparse;
+    int samples;
+    int threads;
+
+    //-|w_j|^2 / 2 for each neuron, so that the nearest neuron has the largest net input.
+    double *bias;
+};
+
+struct som_worker {
+    struct som_shared *shared;
+    int id;
+    Matrix S; //Sum of the samples each neuron won in this thread's shard.
+    double *N; //Number of samples each neuron won.
+    pthread_t thread;
+};
+
+/* Finds the nearest neuron to each sample of this worker's shard and sums the samples by winner. */
+static void* somWorker(void *arg) {
+    struct som_worker *w = (struct som_worker*) arg;
+    struct som_shared *sh = w->shared;
+    Matrix W = sh->W;
+    int out = W->ROWS;
+    int in = W->COLS;
+
+    int lo = (int) ((long) sh->samples * w->id / sh->threads);
+    int hi = (int) ((long) sh->samples * (w->id + 1) / sh->threads);
+
+    scaleMtrx(w->S, 0);
+    int j = out;
+    while (j--)
+        w->N[j] = 0;
+
+    Matrix z = sh->sparse ? makeMatrix(out, 1) : NULL;
+
+    int i = lo;
+    while (i < hi) {
+        double *s;
+        if (sh->sparse) {
+            SparseVector x = sh->sparse[i];
+            gemvSparseMtrx(1, W, x, 0, z);
+
+            int c = 0;
+            j = out;
+            while (j--)
+                if (z->vals[j] + sh->bias[j] >= z->vals[c] + sh->bias[c])
+                    c = j;
+
+            s = w->S->vals + (size_t) c * in;
+            int k = x->nnz;
+            while (k--)
+                s[x->idx[k]] += x->vals[k];
+            w->N[c]++;
+        } else {
+            Matrix x = sh->data[i][0];
+            int c = gemvArgmax(out, in, W->vals, in, x->vals, sh->bias);
+
+            s = w->S->vals + (size_t) c * in;
+            int k = in;
+            while (k--)
+                s[k] += x->vals[k];
+            w->N[c]++;
+        }
+        i++;
+    }
+
+    freeMatrix(z);
+    return NULL;
 }
 
+void batchSomTrain(NeuralNet net, NetTrainKit kit) {
+
+    //Any lazy scale goes into the weights before the threads read them.
+    foldLayerScale(getNetLayer(net, 0));
+    Matrix W = getNetWeights(net, 0);
+    int out = W->ROWS;
+    int in = W->COLS;
+
+    int cols = kit->somCols > 0 && kit->somCols < out ? kit->somCols : out;
+    int rows = (out + cols - 1) / cols;
+
+    struct som_shared sh;
+    sh.W = W;
+    sh.data = kit->data;
+    sh.sparse = kit->sparseInputs;
+    sh.samples = 0;
+    while (sh.data[sh.samples])
+        sh.samples++;
+    sh.threads = kit->threads > 1 ? kit->threads : 1;
+    sh.bias = (double*) malloc(out * sizeof(double));
+
+    struct som_worker workers[sh.threads];
+    int t = sh.threads;
+    while (t--) {
+        workers[t].shared = &sh;
+        workers[t].id = t;
+        workers[t].S = makeMatrix(out, in);
+        workers[t].N = (double*) malloc(out * sizeof(double));
+    }
+
+    Matrix H = makeMatrix(out, out); //Neighborhood of each neuron around each winner
+    Matrix M = makeMatrix(out, in);
+
+    //The radius starts at half the grid and shrinks geometrically.
+    double start = (rows > cols ? rows : cols) / 2.0;
+    if (start < SOM_FINAL_RADIUS)
+        start = SOM_FINAL_RADIUS;
+
+    int cycles = kit->maxCycles;
+    int epoch = 0;
+    while (epoch < cycles) {
+        double radius = cycles > 1 ? start * pow(SOM_FINAL_RADIUS / start, epoch / (cycles - 1.0))
+                                   : SOM_FINAL_RADIUS;
+
+        int j = out;
+        while (j--) {
+            double *w = W->vals + (size_t) j * in;
+            double d = 0;
+            int k = in;
+            while (k--)
+                d += w[k] * w[k];
+            sh.bias[j] = -d / 2;
+        }
+
+        //The calling thread searches shard 0 itself.
+        t = sh.threads;
+        while (--t > 0)
+            pthread_create(&workers[t].thread, NULL, somWorker, &workers[t]);
+        somWorker(&workers[0]);
+        t = sh.threads;
+        while (--t > 0)
+            pthread_join(workers[t].thread, NULL);
+
+        t = sh.threads;
+        while (--t > 0) {
+            axpyMtrx(workers[0].S, 1, workers[t].S);
+            j = out;
+            while (j--)
+                workers[0].N[j] += workers[t].N[j];
+        }
+
+        //Gaussian neighborhood over the distance between neurons on the grid.
+        j = out;
+        while (j--) {
+            int c = out;
+            while (c--) {
+                double dr = j / cols - c / cols;
+                double dc = j % cols - c % cols;
+                H->vals[j * out + c] = exp(-(dr * dr + dc * dc) / (2 * radius * radius));
+            }
+        }
 
+        //Each neuron moves to the mean of the samples won around it, weighted by the neighborhood.
+        gemmMtrx(1, H, workers[0].S, 0, M);
+        j = out;
+        while (j--) {
+            double n = 0;
+            int c = out;
+            while (c--)
+                n += H->vals[j * out + c] * workers[0].N[c];
+
+            //Neurons with no samples nearby stay where they are.
+            if (n < 1e-12)
+                continue;
+
+            double *w = W->vals + (size_t) j * in;
+            double *m = M->vals + (size_t) j * in;
+            int k = in;
+            while (k--)
+                w[k] = m[k] / n;
+        }
+
+        epoch++;
+    }
+
+    t = sh.threads;
+    while (t--) {
+        freeMatrix(workers[t].S);
+        free(workers[t].N);
+    }
+    freeMatrix(H);
+    freeMatrix(M);
+    free(sh.bias);
+}
@@ -1,19 +1,44 @@
 #include "neuralnet.h"
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 struct neuron_layer {
     Matrix W; //Non-recurrent layer weight matrix.
     Matrix R; //Recurrent layer weight matrix, if applicable
+    Matrix b; //Bias added to each output row (each output channel if convolutional), if any.
+    double scale; //Factor the stored W is multiplied by, applied lazily.
     int r; //Number of recurrences
     TransFunc f;
+
+    //Grid geometry of a convolutional layer; kernel is 0 for dense layers.
+    int gridRows;
+    int gridCols;
+    int kernel;
+
+    int sparse; //Nonzero if the layer was marked sparse.
+    SparseMatrix S; //Compressed copy of W used in its place, if sparse enough to pay off.
 };
 
 struct neural_net {
     NeuronLayer *layers;
+    double *params; //Every layer's weights, packed into one buffer.
+    size_t numParams;
+    void *map; //The mapped model file that params points into, if any.
+    size_t mapSize;
 };
 
+/* Each layer's block in the parameter buffer starts on a 64-byte boundary. */
+#define PARAM_ALIGN 8
+
 NeuronLayer makeBlankNeuronLayer(int in, int out, TransFunc func) {
     return makePresetNeuronLayer(
                    makeMatrix(out, in),
@@ -36,13 +61,32 @@ NeuronLayer makePresetNeuronLayer(Matrix W, Matrix R, int r, TransFunc func) {
 
     layer->W = W;
     layer->R = R;
+    layer->b = NULL;
+    layer->scale = 1;
     layer->r = r;
 
     layer->f = func;
+
+    layer->gridRows = 0;
+    layer->gridCols = 0;
+    layer->kernel = 0;
+
+    layer->sparse = 0;
+    layer->S = NULL;
     
     return layer;
 }
 
+NeuronLayer makeConvNeuronLayer(int rows, int cols, int inCh, int outCh, int k, TransFunc func) {
+    NeuronLayer layer = makePresetNeuronLayer(makeMatrix(outCh, inCh * k * k), NULL, 0, func);
+
+    layer->gridRows = rows;
+    layer->gridCols = cols;
+    layer->kernel = k;
+
+    return layer;
+}
+
 void freeNeuronLayer(NeuronLayer layer) {
     freeMatrix(layer->W);
     layer->W = NULL;
@@ -50,20 +94,74 @@ void freeNeuronLayer(NeuronLayer layer) {
     freeMatrix(layer->R);
     layer->R = NULL;
 
+    freeMatrix(layer->b);
+    layer->b = NULL;
+
+    freeSparseMatrix(layer->S);
+    layer->S = NULL;
+
     layer->r = 0;
     layer->f = NULL;
     
     free(layer);
 }
 
+/* The lazy weight scale is folded into the stored weights once it leaves this range. */
+#define SCALE_MIN (1.0 / 4294967296.0)
+#define SCALE_MAX 4294967296.0
+
+void foldLayerScale(NeuronLayer layer) {
+    if (layer->scale == 1)
+        return;
+    scaleMtrx(layer->W, layer->scale);
+
+    //The sparse copy mirrors the stored weights, so it is scaled with them.
+    if (layer->S) {
+        int k = layer->S->nnz;
+        while (k--)
+            layer->S->vals[k] *= layer->scale;
+    }
+    layer->scale = 1;
+}
+
 Matrix getLayerWeights(NeuronLayer layer) {
     return layer->W;
 }
 
+Matrix getLayerScaledWeights(NeuronLayer layer, double *scale) {
+    *scale = layer->scale;
+    return layer->W;
+}
+
+void scaleLayerWeights(NeuronLayer layer, double d) {
+    layer->scale *= d;
+
+    //Also catches a scale of zero, which zeroes the weights.
+    double s = layer->scale < 0 ? -layer->scale : layer->scale;
+    if (!(s >= SCALE_MIN && s <= SCALE_MAX))
+        foldLayerScale(layer);
+}
+
+void updateLayerWeights(NeuronLayer layer, double alpha, Matrix y, Matrix x, double beta) {
+    if (beta != 1)
+        scaleLayerWeights(layer, beta);
+    gerMtrx(alpha / layer->scale, y, x, 1, layer->W);
+}
+
+void updateLayerWeightsSparse(NeuronLayer layer, double alpha, Matrix y, SparseVector x, double beta) {
+    if (beta != 1)
+        scaleLayerWeights(layer, beta);
+    gerSparseMtrx(alpha / layer->scale, y, x, 1, layer->W);
+}
+
 Matrix getLayerRecurrentWeights(NeuronLayer layer) {
     return layer->R;
 }
 
+Matrix getLayerBias(NeuronLayer layer) {
+    return layer->b;
+}
+
 int getLayerRecurrence(NeuronLayer layer) {
     return layer->r;
 }
@@ -72,12 +170,85 @@ TransFunc getLayerFunc(NeuronLayer layer) {
     return layer->f;
 }
 
+int getLayerKernel(NeuronLayer layer) {
+    return layer->kernel;
+}
+
+int getLayerInputSize(NeuronLayer layer) {
+    if (!layer->kernel)
+        return layer->W->COLS;
+
+    int inCh = layer->W->COLS / (layer->kernel * layer->kernel);
+    return layer->gridRows * layer->gridCols * inCh;
+}
+
+int getLayerOutputSize(NeuronLayer layer) {
+    if (!layer->kernel)
+        return layer->W->ROWS;
+
+    return layer->gridRows * layer->gridCols * layer->W->ROWS;
+}
+
+/**
+ * Replaces a layer's matrix. If the old one is a view into a parameter
+ * buffer and the new one has the same shape, its values are copied into
+ * the buffer instead, and the new matrix is freed as the layer now owns it.
+ */
+static void replaceLayerMatrix(Matrix *slot, Matrix m) {
+    Matrix old = *slot;
+    if (old && old->view) {
+        if (m && m->ROWS == old->ROWS && m->COLS == old->COLS) {
+            if (m != old) {
+                copyMtrxInto(old, m);
+                freeMatrix(m);
+            }
+            return;
+        }
+        freeMtrxView(old);
+    }
+    *slot = m;
+}
+
 void setLayerWeights(NeuronLayer layer, Matrix m) {
-    layer->W = m;
+    replaceLayerMatrix(&layer->W, m);
+    layer->scale = 1;
+
+    if (layer->sparse)
+        setLayerSparse(layer, 1);
+}
+
+/* A CSR product only beats the dense one below about one nonzero in this many weights. */
+#define SPARSE_MIN_RATIO 3
+
+int setLayerSparse(NeuronLayer layer, int sparse) {
+    freeSparseMatrix(layer->S);
+    layer->S = NULL;
+    layer->sparse = 0;
+    if (!sparse)
+        return 0;
+    if (layer->kernel)
+        return -1;
+
+    layer->sparse = 1;
+    SparseMatrix S = makeSparseMatrix(layer->W);
+    if ((long) S->nnz * SPARSE_MIN_RATIO > (long) S->ROWS * S->COLS) {
+        freeSparseMatrix(S);
+        return 0;
+    }
+    layer->S = S;
+    return 0;
+}
+
+int isLayerSparse(NeuronLayer layer) {
+    return layer->sparse;
 }
 
 void setLayerRecurrentWeights(NeuronLayer layer, Matrix r) {
-    layer->R = r;
+    replaceLayerMatrix(&layer->R, r);
+}
+
+void setLayerBias(NeuronLayer layer, Matrix b) {
+    replaceLayerMatrix(&layer->b, b);
 }
 
 void setLayerRecurrence(NeuronLayer layer, int r) {
@@ -88,13 +259,50 @@ void setLayerFunc(NeuronLayer layer, TransFunc f) {
     layer->f = f;
 }
 
-Matrix layerFunction(NeuronLayer layer, Matrix x) {
-    Matrix z = layerRaw(layer, x);
+static void layerRawInto(NeuronLayer layer, Matrix x, Matrix out);
+
+/**
+ * Fills out with the layer's bias, one entry per row, so that the product
+ * can be accumulated on top of it. Returns 1 if there was a bias to seed,
+ * else leaves out alone and returns 0.
+ */
+static int seedBias(NeuronLayer layer, Matrix out) {
+    if (!layer->b)
+        return 0;
+
+    int bias = layer->b->ROWS;
+    int cols = out->COLS;
+    int r = out->ROWS;
+    while (r--) {
+        double d = layer->b->vals[r % bias];
+        double *row = out->vals + (size_t) r * cols;
+        int c = cols;
+        while (c--)
+            row[c] = d;
+    }
+    return 1;
+}
+
+/* Applies the transfer function to z, whose bias is already in, in place when possible. */
+static Matrix layerActivate(NeuronLayer layer, Matrix z) {
+    TransFuncInPlace f = getInPlaceTransfer(layer->f);
+    if (f) {
+        f(z);
+        return z;
+    }
+
     Matrix y = layer->f(z);
     freeMatrix(z);
     return y;
 }
 
+Matrix layerFunction(NeuronLayer layer, Matrix x) {
+    //The bias seeds the product, and the activation runs over it in place.
+    Matrix z = makeMatrix(getLayerOutputSize(layer), x->COLS);
+    layerRawInto(layer, x, z);
+    return layerActivate(layer, z);
+}
+
 Matrix* layerRecurrentFunction(NeuronLayer layer, Matrix *xs) {
     Matrix *zs = (Matrix*) malloc((layer->r) * sizeof(Matrix)); makeMatrix(xs[0]->ROWS, 1);
     int i = 0;
@@ -119,11 +327,147 @@ Matrix* layerRecurrentFunction(NeuronLayer layer, Matrix *xs) {
     return zs;
 }
 
+/**
+ * Runs a convolutional layer as a stencil. Each input column holds a grid
+ * of cells, stored row by row with each cell's channels adjacent, and each
+ * output cell is the kernel applied to the k x k neighborhood around it,
+ * with cells beyond the edge of the grid counting as zero.
+ */
+static void convRawInto(NeuronLayer layer, Matrix x, Matrix out) {
+    int rows = layer->gridRows;
+    int cols = layer->gridCols;
+    int k = layer->kernel;
+    int outCh = layer->W->ROWS;
+    int inCh = layer->W->COLS / (k * k);
+    int n = x->COLS;
+    double *W = layer->W->vals;
+    double scale = layer->scale;
+
+    //Each cell's channels start from their bias.
+    if (!seedBias(layer, out)) {
+        int i = out->ROWS * out->COLS;
+        while (i--)
+            out->vals[i] = 0;
+    }
+
+    int y = 0;
+    while (y < rows) {
+        int x0 = 0;
+        while (x0 < cols) {
+            double *o = out->vals + (y * cols + x0) * outCh * n;
+
+            int dy = 0;
+            while (dy < k) {
+                int sy = y + dy - k / 2;
+                int dx = 0;
+                while (dx < k) {
+                    int sx = x0 + dx - k / 2;
+                    if (sy < 0 || sy >= rows || sx < 0 || sx >= cols) {
+                        dx++;
+                        continue;
+                    }
+
+                    //Weights of this kernel tap, and the neighbor cell they read.
+                    double *w = W + (dy * k + dx) * inCh;
+                    double *in = x->vals + (sy * cols + sx) * inCh * n;
+
+                    int oc = 0;
+                    while (oc < outCh) {
+                        int c = 0;
+                        while (c < inCh) {
+                            double a = scale * w[oc * layer->W->COLS + c];
+                            double *src = in + c * n;
+                            double *dst = o + oc * n;
+                            int j = n;
+                            while (j--)
+                                dst[j] += a * src[j];
+                            c++;
+                        }
+                        oc++;
+                    }
+                    dx++;
+                }
+                dy++;
+            }
+            x0++;
+        }
+        y++;
+    }
+}
+
+/* Computes the layer's weighted input plus bias into out, which has the output's shape. */
+static void layerRawInto(NeuronLayer layer, Matrix x, Matrix out) {
+    if (layer->kernel)
+        convRawInto(layer, x, out);
+    else if (layer->S) {
+        mulSparseMInto(out, layer->S, x);
+        if (layer->scale != 1)
+            scaleMtrx(out, layer->scale);
+        if (layer->b) {
+            int bias = layer->b->ROWS;
+            int r = out->ROWS;
+            while (r--) {
+                double d = layer->b->vals[r % bias];
+                double *row = out->vals + (size_t) r * out->COLS;
+                int c = out->COLS;
+                while (c--)
+                    row[c] += d;
+            }
+        }
+    } else
+        gemmMtrx(layer->scale, layer->W, x, seedBias(layer, out), out);
+}
+
 Matrix layerRaw(NeuronLayer layer, Matrix x) {
-    Matrix Wx = mulMtrxM(layer->W, x);
+    Matrix Wx = makeMatrix(getLayerOutputSize(layer), x->COLS);
+    layerRawInto(layer, x, Wx);
+    return Wx;
+}
+
+/* Computes the weighted input of a sparse input vector into out. */
+static void layerSparseRawInto(NeuronLayer layer, SparseVector x, Matrix out) {
+    if (!layer->kernel && !layer->S) {
+        gemvSparseMtrx(layer->scale, layer->W, x, seedBias(layer, out), out);
+        return;
+    }
+
+    //Stencils and sparse weights gain little from a sparse input.
+    Matrix d = sparseVecToDense(x);
+    layerRawInto(layer, d, out);
+    freeMatrix(d);
+}
+
+Matrix layerSparseRaw(NeuronLayer layer, SparseVector x) {
+    Matrix Wx = makeMatrix(getLayerOutputSize(layer), 1);
+    layerSparseRawInto(layer, x, Wx);
     return Wx;
 }
 
+Matrix layerSparseFunction(NeuronLayer layer, SparseVector x) {
+    Matrix z = makeMatrix(getLayerOutputSize(layer), 1);
+    layerSparseRawInto(layer, x, z);
+    return layerActivate(layer, z);
+}
+
+int layerWinner(NeuronLayer layer, Matrix x) {
+    //A positive scale leaves the winner alone unless there is a bias to weigh against.
+    int scaled = layer->scale != 1 && (layer->b || layer->scale <= 0);
+
+    if (!layer->kernel && !layer->S && !scaled)
+        return gemvArgmax(layer->W->ROWS, layer->W->COLS, layer->W->vals, layer->W->COLS,
+                          x->vals, layer->b ? layer->b->vals : NULL);
+
+    Matrix z = layerRaw(layer, x);
+    int best = 0;
+    int i = z->ROWS;
+    while (i--)
+        if (z->vals[i] >= z->vals[best])
+            best = i;
+    freeMatrix(z);
+
+    return best;
+}
+
 NeuralNet makeNeuralNet(int sizes[]) {
     
     NeuralNet net = (NeuralNet) malloc(sizeof(struct neural_net));
@@ -142,17 +486,142 @@ NeuralNet makeNeuralNet(int sizes[]) {
     }
     net->layers[i] = NULL;
 
+    net->params = NULL;
+    net->numParams = 0;
+    net->map = NULL;
+    net->mapSize = 0;
+    packNetParams(net);
+
+    return net;
+
+}
+
+NeuralNet makeNeuralNetFromLayers(NeuronLayer layers[]) {
+    
+    NeuralNet net = (NeuralNet) malloc(sizeof(struct neural_net));
+
+    int size = 0;
+    while (layers[size]) size++;
+
+    net->layers = (NeuronLayer*) malloc((size + 1) * sizeof(NeuronLayer));
+    int i = size + 1;
+    while (i--)
+        net->layers[i] = layers[i];
+
+    net->params = NULL;
+    net->numParams = 0;
+    net->map = NULL;
+    net->mapSize = 0;
+    packNetParams(net);
+
     return net;
 
 }
 
+/* Length of a matrix's block in the parameter buffer. */
+static size_t paramBlockSize(Matrix m) {
+    if (!m)
+        return 0;
+    return ((size_t) m->ROWS * m->COLS + PARAM_ALIGN - 1) / PARAM_ALIGN * PARAM_ALIGN;
+}
+
+/* Moves a layer matrix into the buffer at vals and leaves a view in its place. */
+static void packParam(Matrix *slot, double *vals) {
+    Matrix m = *slot;
+    if (!m)
+        return;
+
+    *slot = copyMtrxInto(makeMtrxView(m->ROWS, m->COLS, vals), m);
+    if (m->view)
+        freeMtrxView(m);
+    else
+        freeMatrix(m);
+}
+
+/* Frees or unmaps the parameter buffer. */
+static void releaseNetParams(NeuralNet net) {
+    if (net->map)
+        munmap(net->map, net->mapSize);
+    else
+        free(net->params);
+
+    net->params = NULL;
+    net->map = NULL;
+    net->mapSize = 0;
+}
+
+void packNetParams(NeuralNet net) {
+    int depth = getNetDepth(net);
+
+    size_t n = 0;
+    int i = depth;
+    while (i--)
+        n += paramBlockSize(net->layers[i]->W) + paramBlockSize(net->layers[i]->R)
+           + paramBlockSize(net->layers[i]->b);
+
+    //Padding stays zeroed so that snapshots of the buffer are deterministic.
+    double *params = (double*) aligned_alloc(PARAM_ALIGN * sizeof(double),
+                                             (n ? n : PARAM_ALIGN) * sizeof(double));
+    size_t j = n;
+    while (j--)
+        params[j] = 0;
+
+    size_t offset = 0;
+    i = 0;
+    while (i < depth) {
+        NeuronLayer layer = net->layers[i];
+        size_t w = paramBlockSize(layer->W);
+        size_t r = paramBlockSize(layer->R);
+        size_t b = paramBlockSize(layer->b);
+        foldLayerScale(layer);
+        packParam(&layer->W, params + offset);
+        packParam(&layer->R, params + offset + w);
+        packParam(&layer->b, params + offset + w + r);
+        offset += w + r + b;
+        i++;
+    }
+
+    releaseNetParams(net);
+    net->params = params;
+    net->numParams = n;
+}
+
+double* getNetParams(NeuralNet net) {
+    //Readers of the buffer expect the real weights.
+    int i = getNetDepth(net);
+    while (i--)
+        foldLayerScale(net->layers[i]);
+    return net->params;
+}
+
+size_t getNetParamCount(NeuralNet net) {
+    return net->numParams;
+}
+
 void freeNeuralNet(NeuralNet net) {
     int i = getNetDepth(net);
     while (i--) {
-        freeNeuronLayer(net->layers[i]);
+        NeuronLayer layer = net->layers[i];
+
+        //Views into the parameter buffer go with the buffer.
+        if (layer->W && layer->W->view) {
+            freeMtrxView(layer->W);
+            layer->W = NULL;
+        }
+        if (layer->R && layer->R->view) {
+            freeMtrxView(layer->R);
+            layer->R = NULL;
+        }
+        if (layer->b && layer->b->view) {
+            freeMtrxView(layer->b);
+            layer->b = NULL;
+        }
+
+        freeNeuronLayer(layer);
         net->layers[i] = NULL;
     }
     free(net->layers);
+    releaseNetParams(net);
 
     free(net);
 }
@@ -162,7 +631,7 @@ NeuronLayer getNetLayer(NeuralNet net, int layer) {
 }
 
 Matrix getNetWeights(NeuralNet net, int layer) {
-    return net->layers[layer]->W;
+    return getLayerWeights(net->layers[layer]);
 }
 
 int getNetDepth(NeuralNet net) {
@@ -174,18 +643,136 @@ int getNetDepth(NeuralNet net) {
 }
 
 Matrix netFunction(NeuralNet net, Matrix x) {
+    return netBatchFunction(net, x);
+}
+
+Matrix netBatchFunction(NeuralNet net, Matrix X) {
     
-    Matrix z = mulMtrxC(x, 1); //Duplicate the input
+    //The first layer reads the input directly, so it is never copied.
+    Matrix Z = NULL;
+    int i = 0;
+    while(net->layers[i]) {
+        Matrix tmp = Z;
+        Z = layerFunction(net->layers[i], Z ? Z : X);
+        freeMatrix(tmp);
+        i++;
+    }
+
+    return Z ? Z : cloneMatrix(X);
+
+}
+
+int netWinner(NeuralNet net, Matrix x) {
+    int depth = getNetDepth(net);
+    if (!depth)
+        return -1;
+
+    Matrix Z = NULL;
     int i = 0;
+    while (i < depth - 1) {
+        Matrix tmp = Z;
+        Z = layerFunction(net->layers[i], Z ? Z : x);
+        freeMatrix(tmp);
+        i++;
+    }
+
+    int winner = layerWinner(net->layers[i], Z ? Z : x);
+    freeMatrix(Z);
+    return winner;
+}
+
+Matrix netSparseFunction(NeuralNet net, SparseVector x) {
+    if (!net->layers[0])
+        return sparseVecToDense(x);
+
+    Matrix Z = layerSparseFunction(net->layers[0], x);
+    int i = 1;
     while(net->layers[i]) {
-        Matrix tmp = z;
-        z = layerFunction(net->layers[i], z);
+        Matrix tmp = Z;
+        Z = layerFunction(net->layers[i], Z);
         freeMatrix(tmp);
         i++;
     }
 
-    return z;
+    return Z;
+}
+
+/**
+ * layerWinner for a sparse input. Each row's product is summed straight from
+ * the weights in the active columns, from the CSR copy if there is one, and
+ * only the best row so far is kept, so nothing is allocated.
+ */
+static int layerSparseWinner(NeuronLayer layer, SparseVector x) {
+    if (layer->kernel) {
+        Matrix d = sparseVecToDense(x);
+        int winner = layerWinner(layer, d);
+        freeMatrix(d);
+        return winner;
+    }
 
+    SparseMatrix S = layer->S;
+    double *b = layer->b ? layer->b->vals : NULL;
+    int best = -1;
+    double bestVal = 0;
+
+    int r = 0;
+    while (r < layer->W->ROWS) {
+        double d = 0;
+        int k = x->nnz;
+        if (S) {
+            //The columns of a CSR row are in order, so each is found by bisection.
+            while (k--) {
+                int lo = S->rowPtr[r];
+                int hi = S->rowPtr[r+1];
+                while (lo < hi) {
+                    int mid = (lo + hi) / 2;
+                    if (S->colIdx[mid] < x->idx[k])
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+                if (lo < S->rowPtr[r+1] && S->colIdx[lo] == x->idx[k])
+                    d += S->vals[lo] * x->vals[k];
+            }
+        } else {
+            const double *w = layer->W->vals + (size_t) r * layer->W->COLS;
+            while (k--)
+                d += w[x->idx[k]] * x->vals[k];
+        }
+        d = layer->scale * d + (b ? b[r] : 0);
+
+        //The first of equal maxima wins, as in layerWinner.
+        if (best < 0 || d > bestVal) {
+            best = r;
+            bestVal = d;
+        }
+        r++;
+    }
+
+    return best;
+}
+
+int netSparseWinner(NeuralNet net, SparseVector x) {
+    int depth = getNetDepth(net);
+    if (!depth)
+        return -1;
+
+    if (depth > 1) {
+        Matrix Z = layerSparseFunction(net->layers[0], x);
+        int i = 1;
+        while (i < depth - 1) {
+            Matrix tmp = Z;
+            Z = layerFunction(net->layers[i], Z);
+            freeMatrix(tmp);
+            i++;
+        }
+
+        int winner = layerWinner(net->layers[i], Z);
+        freeMatrix(Z);
+        return winner;
+    }
+
+    return layerSparseWinner(net->layers[0], x);
 }
 
 Matrix* netRecurrentFunction(NeuralNet net, Matrix *xs) {
@@ -228,3 +815,394 @@ Matrix* netRecurrentFunction(NeuralNet net, Matrix *xs) {
 }
 
 
+
+struct net_plan {
+    NeuralNet net;
+    int depth;
+    int rows; //Rows of each buffer.
+    int cols; //Most inputs the buffers can hold at once.
+    struct matrix buf[2]; //Ping-pong activation buffers.
+};
+
+NetPlan compileNeuralNet(NeuralNet net, int cols) {
+    NetPlan plan = (NetPlan) malloc(sizeof(struct net_plan));
+    plan->net = net;
+    plan->depth = getNetDepth(net);
+    plan->cols = cols > 0 ? cols : 1;
+
+    //Size both buffers to the widest layer, counting the input.
+    int rows = plan->depth ? getLayerInputSize(net->layers[0]) : 0;
+    int i = plan->depth;
+    while (i--) {
+        NeuronLayer layer = net->layers[i];
+        if (getLayerOutputSize(layer) > rows)
+            rows = getLayerOutputSize(layer);
+    }
+    plan->rows = rows;
+
+    i = 2;
+    while (i--) {
+        plan->buf[i].ROWS = rows;
+        plan->buf[i].COLS = plan->cols;
+        plan->buf[i].vals = (double*) malloc(rows * plan->cols * sizeof(double));
+        plan->buf[i].arena = NULL;
+        plan->buf[i].view = 1;
+    }
+
+    return plan;
+}
+
+void freeNetPlan(NetPlan plan) {
+    if (!plan)
+        return;
+
+    free(plan->buf[0].vals);
+    free(plan->buf[1].vals);
+    free(plan);
+}
+
+Matrix runNetPlan(NetPlan plan, Matrix x) {
+    //The buffers only hold what the plan was compiled for.
+    if (x->COLS > plan->cols || (plan->depth ? x->ROWS != getLayerInputSize(plan->net->layers[0])
+                                             : x->ROWS > plan->rows))
+        return NULL;
+
+    Matrix in = x;
+    Matrix out = &plan->buf[0];
+
+    int i = 0;
+    while (i < plan->depth) {
+        NeuronLayer layer = plan->net->layers[i];
+        out = &plan->buf[i & 1];
+        out->ROWS = getLayerOutputSize(layer);
+        out->COLS = x->COLS;
+
+        //Looked up on every run, so that setLayerFunc needs no new plan.
+        TransFuncInPlace f = getInPlaceTransfer(layer->f);
+        layerRawInto(layer, in, out);
+
+        if (f)
+            f(out);
+        else {
+            Matrix y = layer->f(out);
+            copyMtrxInto(out, y);
+            freeMatrix(y);
+        }
+
+        in = out;
+        i++;
+    }
+
+    if (!plan->depth) {
+        out->ROWS = x->ROWS;
+        out->COLS = x->COLS;
+        copyMtrxInto(out, x);
+    }
+
+    return out;
+}
+
+/***************/
+/* MODEL FILES */
+/***************/
+
+#define MODEL_MAGIC "NNETLIB"
+#define MODEL_VERSION 2
+#define MODEL_BYTE_ORDER 0x01020304u
+
+/* The parameter section starts on a boundary of this many bytes. */
+#define MODEL_ALIGN 64
+
+struct model_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder; //Written natively; files only load on hosts of the same order.
+    uint32_t depth;
+    uint32_t reserved;
+    uint64_t paramOffset; //Byte offset of the parameter buffer.
+    uint64_t numParams; //Length of the parameter buffer in doubles.
+};
+
+struct model_layer {
+    int32_t rows;
+    int32_t cols;
+    int32_t recurrence;
+    int32_t recurrent; //Nonzero if the layer has rows x rows recurrent weights.
+    int32_t func; //See getTransferId.
+    int32_t gridRows; //Grid of a convolutional layer.
+    int32_t gridCols;
+    int32_t kernel; //Kernel size of a convolutional layer, or 0 if dense.
+    int32_t bias; //Nonzero if the layer has a rows x 1 bias.
+    int32_t sparse; //Nonzero if the layer was marked sparse.
+};
+
+/* Size of a layer table entry in a file of the given version, or 0 if unknown. */
+static size_t modelLayerSize(uint32_t version) {
+    //Version 1 entries stop before the bias, so those layers have none.
+    if (version == 1)
+        return offsetof(struct model_layer, bias);
+    return version == MODEL_VERSION ? sizeof(struct model_layer) : 0;
+}
+
+static uint64_t modelParamOffset(uint32_t version, uint32_t depth) {
+    uint64_t n = sizeof(struct model_header) + depth * modelLayerSize(version);
+    return (n + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN;
+}
+
+/* Widens a layer table as stored in the file to current entries, zeroing any missing fields. */
+static struct model_layer* readModelLayers(struct model_header *header, const char *table) {
+    size_t size = modelLayerSize(header->version);
+    struct model_layer *layers = (struct model_layer*) calloc(
+            header->depth ? header->depth : 1, sizeof(struct model_layer));
+
+    uint32_t i = header->depth;
+    while (i--)
+        memcpy(&layers[i], table + i * size, size);
+    return layers;
+}
+
+int saveNeuralNet(NeuralNet net, const char *path) {
+    int depth = getNetDepth(net);
+
+    struct model_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.byteOrder = MODEL_BYTE_ORDER;
+    header.depth = depth;
+    header.paramOffset = modelParamOffset(MODEL_VERSION, depth);
+
+    struct model_layer layers[depth ? depth : 1];
+    memset(layers, 0, sizeof(layers));
+
+    int i = depth;
+    while (i--) {
+        NeuronLayer layer = net->layers[i];
+        foldLayerScale(layer);
+
+        //Only packed, built-in layers can be described by the file.
+        if (!layer->W->view || (layer->R && !layer->R->view) || (layer->b && !layer->b->view)
+            || getTransferId(layer->f) < 0)
+            return -1;
+
+        layers[i].rows = layer->W->ROWS;
+        layers[i].cols = layer->W->COLS;
+        layers[i].recurrence = layer->r;
+        layers[i].recurrent = layer->R != NULL;
+        layers[i].func = getTransferId(layer->f);
+        layers[i].gridRows = layer->gridRows;
+        layers[i].gridCols = layer->gridCols;
+        layers[i].kernel = layer->kernel;
+        layers[i].bias = layer->b != NULL;
+        layers[i].sparse = layer->sparse;
+    }
+    header.numParams = net->numParams;
+
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return -1;
+
+    char pad[MODEL_ALIGN] = {0};
+    size_t padding = header.paramOffset - sizeof(header) - depth * sizeof(struct model_layer);
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1
+          && fwrite(layers, sizeof(struct model_layer), depth, file) == (size_t) depth
+          && fwrite(pad, 1, padding, file) == padding
+          && fwrite(net->params, sizeof(double), net->numParams, file) == net->numParams;
+
+    return fclose(file) == 0 && ok ? 0 : -1;
+}
+
+/* Checks a header and its layer table against each other and the file size. */
+static int checkModel(struct model_header *header, struct model_layer *layers, size_t fileSize) {
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(MODEL_MAGIC))
+        || !modelLayerSize(header->version)
+        || header->byteOrder != MODEL_BYTE_ORDER
+        || header->paramOffset != modelParamOffset(header->version, header->depth))
+        return 0;
+
+    uint64_t n = 0;
+    uint32_t i = 0;
+    while (i < header->depth) {
+        struct model_layer *l = &layers[i];
+        if (l->rows <= 0 || l->cols <= 0 || l->func < 0 || l->func > TRANSFER_ID_MAX)
+            return 0;
+        if (l->kernel && (l->kernel < 0 || l->gridRows <= 0 || l->gridCols <= 0
+                          || l->recurrent || l->sparse || l->cols % (l->kernel * l->kernel)))
+            return 0;
+
+        //Each layer must take the previous layer's output.
+        int64_t cells = l->kernel ? (int64_t) l->gridRows * l->gridCols : 1;
+        int64_t in = cells * (l->kernel ? l->cols / (l->kernel * l->kernel) : l->cols);
+        if (i) {
+            struct model_layer *p = &layers[i-1];
+            int64_t out = (p->kernel ? (int64_t) p->gridRows * p->gridCols : 1) * p->rows;
+            if (in != out)
+                return 0;
+        }
+
+        n += ((uint64_t) l->rows * l->cols + PARAM_ALIGN - 1) / PARAM_ALIGN * PARAM_ALIGN;
+        if (l->recurrent)
+            n += ((uint64_t) l->rows * l->rows + PARAM_ALIGN - 1) / PARAM_ALIGN * PARAM_ALIGN;
+        if (l->bias)
+            n += ((uint64_t) l->rows + PARAM_ALIGN - 1) / PARAM_ALIGN * PARAM_ALIGN;
+
+        //Keeps n * sizeof(double) from overflowing below.
+        if (n > fileSize / sizeof(double))
+            return 0;
+        i++;
+    }
+
+    return n == header->numParams
+        && header->paramOffset <= fileSize
+        && n * sizeof(double) <= fileSize - header->paramOffset;
+}
+
+/* Builds the layers of a model over a parameter buffer laid out as by packNetParams. */
+static NeuralNet makeModelNet(struct model_header *header, struct model_layer *layers, double *params) {
+    NeuralNet net = (NeuralNet) malloc(sizeof(struct neural_net));
+    net->layers = (NeuronLayer*) malloc((header->depth + 1) * sizeof(NeuronLayer));
+    net->params = params;
+    net->numParams = header->numParams;
+    net->map = NULL;
+    net->mapSize = 0;
+
+    size_t offset = 0;
+    uint32_t i = 0;
+    while (i < header->depth) {
+        struct model_layer *l = &layers[i];
+
+        Matrix W = makeMtrxView(l->rows, l->cols, params + offset);
+        offset += paramBlockSize(W);
+
+        Matrix R = NULL;
+        if (l->recurrent) {
+            R = makeMtrxView(l->rows, l->rows, params + offset);
+            offset += paramBlockSize(R);
+        }
+
+        Matrix b = NULL;
+        if (l->bias) {
+            b = makeMtrxView(l->rows, 1, params + offset);
+            offset += paramBlockSize(b);
+        }
+
+        NeuronLayer layer = makePresetNeuronLayer(W, R, l->recurrence, getTransferById(l->func));
+        layer->b = b;
+        layer->gridRows = l->gridRows;
+        layer->gridCols = l->gridCols;
+        layer->kernel = l->kernel;
+        if (l->sparse)
+            setLayerSparse(layer, 1);
+
+        net->layers[i] = layer;
+        i++;
+    }
+    net->layers[i] = NULL;
+
+    return net;
+}
+
+NeuralNet loadNeuralNet(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file)
+        return NULL;
+
+    long size = -1;
+    if (!fseek(file, 0, SEEK_END))
+        size = ftell(file);
+
+    //The layer table is sized by the file before anything is allocated for it.
+    struct model_header header;
+    if (size < (long) sizeof(header) || fseek(file, 0, SEEK_SET)
+        || fread(&header, sizeof(header), 1, file) != 1
+        || !modelLayerSize(header.version)
+        || header.depth > (size - sizeof(header)) / modelLayerSize(header.version)) {
+        fclose(file);
+        return NULL;
+    }
+
+    size_t entry = modelLayerSize(header.version);
+    char *table = (char*) malloc(header.depth ? header.depth * entry : 1);
+    struct model_layer *layers = NULL;
+    if (fread(table, entry, header.depth, file) == header.depth)
+        layers = readModelLayers(&header, table);
+    free(table);
+
+    if (!layers || !checkModel(&header, layers, size)) {
+        free(layers);
+        fclose(file);
+        return NULL;
+    }
+
+    size_t n = header.numParams;
+    double *params = (double*) aligned_alloc(PARAM_ALIGN * sizeof(double),
+                                             (n ? n : PARAM_ALIGN) * sizeof(double));
+    if (fseek(file, header.paramOffset, SEEK_SET)
+        || fread(params, sizeof(double), n, file) != n) {
+        free(params);
+        free(layers);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+
+    NeuralNet net = makeModelNet(&header, layers, params);
+    free(layers);
+    return net;
+}
+
+NeuralNet mapNeuralNet(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) || (size_t) st.st_size < sizeof(struct model_header)) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    struct model_header *header = (struct model_header*) map;
+    if (!modelLayerSize(header->version)
+        || header->depth > (st.st_size - sizeof(struct model_header)) / modelLayerSize(header->version)) {
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    struct model_layer *layers = readModelLayers(header, (char*) (header + 1));
+    if (!checkModel(header, layers, st.st_size)) {
+        free(layers);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    NeuralNet net = makeModelNet(header, layers, (double*) ((char*) map + header->paramOffset));
+    free(layers);
+
+    //Sparse layers run from their copies, so the pages of their dense weights
+    //are handed back. They fault in again from the file if anything reads them.
+    long page = sysconf(_SC_PAGESIZE);
+    int i = 0;
+    while (net->layers[i]) {
+        NeuronLayer layer = net->layers[i];
+        if (layer->S && page > 0) {
+            uintptr_t lo = (uintptr_t) layer->W->vals;
+            uintptr_t hi = lo + (uintptr_t) layer->W->ROWS * layer->W->COLS * sizeof(double);
+            lo = (lo + page - 1) / page * page;
+            hi = hi / page * page;
+            if (hi > lo)
+                madvise((void*) lo, hi - lo, MADV_DONTNEED);
+        }
+        i++;
+    }
+    net->map = map;
+    net->mapSize = st.st_size;
+
+    return net;
+}
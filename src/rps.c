@@ -30,11 +30,33 @@ void printMove(char *name, int move) {
 
 }
 
+/*
+ The input for a round: the state of the previous moves, one of nine,
+ as a one-hot vector. With no previous moves, every state is active.
+*/
+static SparseVector rpsState(int pPrev, int bPrev) {
+    if (pPrev >= 0 && bPrev >= 0) {
+        int state = 3 * pPrev + bPrev;
+        return makeSparseVector(9, 1, &state, NULL);
+    }
+
+    int states[9];
+    int k = 9;
+    while (k--)
+        states[k] = k;
+    return makeSparseVector(9, 9, states, NULL);
+}
+
+/*
+ The training pair for a round. The input is rpsState as a dense vector,
+ for rules run without sparse inputs.
+*/
 Matrix* rpsPair(int pPrev, int bPrev, int next) {
     Matrix *pair = (Matrix*) malloc(2 * sizeof(Matrix));
 
-    pair[0] = makeMatrix(9, 1);
-    setMtrxVal(pair[0], 3 * pPrev + bPrev, 0, 1);
+    SparseVector x = rpsState(pPrev, bPrev);
+    pair[0] = sparseVecToDense(x);
+    freeSparseVector(x);
 
     pair[1] = makeMatrix(3, 1);
     setMtrxVal(pair[1], next, 0, 1);
@@ -45,12 +67,16 @@ Matrix* rpsPair(int pPrev, int bPrev, int next) {
 
 void trainMoveSequence(NeuralNet net, int pPrev, int bPrev, int next) {
     struct nettrainkit kit;
+    initNetTrainKit(&kit);
 
     Matrix *data[2];
     data[0] = rpsPair(pPrev, bPrev, next);
     data[1] = NULL;
 
+    SparseVector x = rpsState(pPrev, bPrev);
+
     kit.data = &data[0];
+    kit.sparseInputs = &x;
 
     kit.learnRate = 1;
     kit.maxCycles = 1;
@@ -58,34 +84,20 @@ void trainMoveSequence(NeuralNet net, int pPrev, int bPrev, int next) {
     
     supervisedHebbRuleTrain(net, &kit);
 
-    //freeMatrix(data[0][0]);
-    //freeMatrix(data[0][1]);
+    freeSparseVector(x);
+    freeMatrix(data[0][0]);
+    freeMatrix(data[0][1]);
     free(data[0]);
 }
 
 int chooseMove(NeuralNet net, int pPrev, int bPrev) {
     
     //Make an input vector based on the previous move.
-    Matrix x = makeMatrix(9, 1);
-    if (pPrev >= 0 && bPrev >= 0) //Activate the state of the prev move.
-        setMtrxVal(x, 3 * pPrev + bPrev, 0, 1);
-    else {
-        //If no data available, 
-        int k = 9;
-        while (k--)
-            setMtrxVal(x, k, 0, 1);
-    }
+    SparseVector x = rpsState(pPrev, bPrev);
 
-    Matrix y = netFunction(net, x);
-    freeMatrix(x);
-    
     //Determine which move had the largest activation.
-    int m = 0;
-    int i = 3;
-    while (--i)
-        if (getMtrxVal(y, m, 0) < getMtrxVal(y, i, 0)) {
-            m = i;
-        }
+    int m = netSparseWinner(net, x);
+    freeSparseVector(x);
    
     return (m+1) % 3;
 
@@ -0,0 +1,201 @@
+#include "matrix.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+SparseMatrix makeSparseMatrix(Matrix A) {
+    SparseMatrix S = (SparseMatrix) malloc(sizeof(struct sparse_matrix));
+
+    S->ROWS = A->ROWS;
+    S->COLS = A->COLS;
+
+    int n = A->ROWS * A->COLS;
+    int nnz = 0;
+    int i = n;
+    while (i--)
+        if (A->vals[i] != 0)
+            nnz++;
+
+    S->nnz = nnz;
+    S->rowPtr = (int*) malloc((A->ROWS + 1) * sizeof(int));
+    S->colIdx = (int*) malloc((nnz ? nnz : 1) * sizeof(int));
+    S->vals = (double*) malloc((nnz ? nnz : 1) * sizeof(double));
+
+    int k = 0;
+    int r = 0;
+    while (r < A->ROWS) {
+        S->rowPtr[r] = k;
+        int c = 0;
+        while (c < A->COLS) {
+            double d = A->vals[r * A->COLS + c];
+            if (d != 0) {
+                S->colIdx[k] = c;
+                S->vals[k] = d;
+                k++;
+            }
+            c++;
+        }
+        r++;
+    }
+    S->rowPtr[r] = k;
+
+    return S;
+}
+
+void freeSparseMatrix(SparseMatrix S) {
+    if (!S)
+        return;
+
+    free(S->rowPtr);
+    free(S->colIdx);
+    free(S->vals);
+    free(S);
+}
+
+Matrix sparseToDense(SparseMatrix S) {
+    Matrix A = makeMatrix(S->ROWS, S->COLS);
+
+    int r = S->ROWS;
+    while (r--) {
+        int k = S->rowPtr[r];
+        while (k < S->rowPtr[r+1]) {
+            A->vals[r * S->COLS + S->colIdx[k]] = S->vals[k];
+            k++;
+        }
+    }
+
+    return A;
+}
+
+Matrix mulSparseM(SparseMatrix a, Matrix b) {
+    return mulSparseMInto(makeMatrix(a->ROWS, b->COLS), a, b);
+}
+
+Matrix mulSparseMInto(Matrix dst, SparseMatrix a, Matrix b) {
+    int n = b->COLS;
+
+    int r = a->ROWS;
+    if (n == 1) {
+        //Sparse matrix-vector product: one sparse dot product per row.
+        while (r--) {
+            double d = 0;
+            int k = a->rowPtr[r];
+            while (k < a->rowPtr[r+1]) {
+                d += a->vals[k] * b->vals[a->colIdx[k]];
+                k++;
+            }
+            dst->vals[r] = d;
+        }
+        return dst;
+    }
+
+    //Each output row sums the rows of b picked out by the nonzeros of a.
+    while (r--) {
+        double *out = dst->vals + r * n;
+        int j = n;
+        while (j--)
+            out[j] = 0;
+
+        int k = a->rowPtr[r];
+        while (k < a->rowPtr[r+1]) {
+            double v = a->vals[k];
+            double *row = b->vals + a->colIdx[k] * n;
+            j = 0;
+            while (j < n) {
+                out[j] += v * row[j];
+                j++;
+            }
+            k++;
+        }
+    }
+
+    return dst;
+}
+
+SparseVector makeSparseVector(int rows, int nnz, const int *idx, const double *vals) {
+    //The kernels index rows straight from idx, so a bad index would go out of bounds.
+    if (rows < 0 || nnz < 0 || (nnz && !idx))
+        return NULL;
+
+    int k = nnz;
+    while (k--)
+        if (idx[k] < 0 || idx[k] >= rows)
+            return NULL;
+
+    SparseVector v = (SparseVector) malloc(sizeof(struct sparse_vector));
+
+    v->ROWS = rows;
+    v->nnz = nnz;
+    v->idx = (int*) malloc((nnz ? nnz : 1) * sizeof(int));
+    v->vals = (double*) malloc((nnz ? nnz : 1) * sizeof(double));
+
+    k = nnz;
+    while (k--) {
+        v->idx[k] = idx[k];
+        v->vals[k] = vals ? vals[k] : 1;
+    }
+
+    return v;
+}
+
+void freeSparseVector(SparseVector v) {
+    if (!v)
+        return;
+
+    free(v->idx);
+    free(v->vals);
+    free(v);
+}
+
+Matrix sparseVecToDense(SparseVector v) {
+    Matrix x = makeMatrix(v->ROWS, 1);
+
+    int k = v->nnz;
+    while (k--)
+        x->vals[v->idx[k]] += v->vals[k];
+
+    return x;
+}
+
+void gemvSparseMtrx(double alpha, Matrix a, SparseVector x, double beta, Matrix y) {
+    if (x->ROWS != a->COLS || y->ROWS != a->ROWS) {
+        printf("Dangerous mult. btwn %i x %i matrix and sparse %i vector into %i vector.\n",
+               a->ROWS, a->COLS, x->ROWS, y->ROWS);
+    }
+
+    int n = a->COLS;
+    int r = a->ROWS;
+    while (r--) {
+        //A dot product over the active columns only.
+        const double *row = a->vals + (size_t) r * n;
+        double d = 0;
+        int k = x->nnz;
+        while (k--)
+            d += row[x->idx[k]] * x->vals[k];
+
+        y->vals[r] = alpha * d + (beta == 0 ? 0 : beta * y->vals[r]);
+    }
+}
+
+void gerSparseMtrx(double alpha, Matrix x, SparseVector y, double beta, Matrix a) {
+    if (x->ROWS != a->ROWS || y->ROWS != a->COLS) {
+        printf("Dangerous outer product of %i and sparse %i vectors into %i x %i matrix.\n",
+               x->ROWS, y->ROWS, a->ROWS, a->COLS);
+    }
+
+    if (beta != 1)
+        scaleMtrx(a, beta);
+
+    int n = a->COLS;
+    int r = a->ROWS;
+    while (r--) {
+        double ax = alpha * x->vals[r];
+        if (ax == 0)
+            continue;
+
+        double *row = a->vals + (size_t) r * n;
+        int k = y->nnz;
+        while (k--)
+            row[y->idx[k]] += ax * y->vals[k];
+    }
+}
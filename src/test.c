@@ -1,25 +1,31 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
+#include <math.h>
 
 #include "neuralnet.h"
 #include "nettrain.h"
 
 void backpropXorDemo() {
     /* The layer sizes. This indicates that we want a network with
-       two layers with two inputs and one output. We use three inputs
-       because one input will be a bias value that is always equal to one. */
-    int sizes[] = {3, 7, 1, 0};
+       two layers with two inputs and one output. */
+    int sizes[] = {2, 7, 1, 0};
     
     //Builds a blank network with the given sizes.
     printf("Building %i-%i-%i network...\n", sizes[0], sizes[1], sizes[2]);
     NeuralNet network = makeNeuralNet(sizes);
+
+    //Both layers get a bias, which must then be packed with the weights.
+    int i = 2;
+    while (i--)
+        setLayerBias(getNetLayer(network, i), makeMatrix(sizes[i+1], 1));
+    packNetParams(network);
     
     srand(time(NULL));
 
-    int i = 2;
+    i = 4;
     while (i--) {
-        Matrix M = getNetWeights(network, i);
+        Matrix M = i < 2 ? getNetWeights(network, i) : getLayerBias(getNetLayer(network, i - 2));
         int r = M->ROWS;
         while(r--) {
             int c = M->COLS;
@@ -36,7 +42,7 @@ void backpropXorDemo() {
     
     //In order to train, we need a training kit.
     printf("Allocating training kit...\n");
-    NetTrainKit kit = (NetTrainKit) malloc(sizeof(struct nettrainkit));
+    NetTrainKit kit = makeNetTrainKit();
     
     //We might need to have the transfer functions and their derivatives.
     printf("Building training kit...\n");
@@ -70,11 +76,10 @@ void backpropXorDemo() {
             //Each unit of training data is a pair of matrices.
             kit->data[2*p + q] = (Matrix*) malloc(2 * sizeof(Matrix));
 
-            //The input is size 3, so create a 3x1 input vector.
-            Matrix x = makeMatrix(3, 1);
+            //The input is size 2, so create a 2x1 input vector.
+            Matrix x = makeMatrix(2, 1);
             setMtrxVal(x, 0, 0, p);
             setMtrxVal(x, 1, 0, q);
-            setMtrxVal(x, 2, 0, 1);
             kit->data[2*p + q][0] = x;
 
             //The output is size 1, so create a 1x1 output vector.
@@ -95,7 +100,9 @@ void backpropXorDemo() {
     printf("Complete!\n\n");
     
     printf("W[0]: "); printMatrix(getNetWeights(network, 0));
+    printf("b[0]: "); printVector(getLayerBias(getNetLayer(network, 0)));
     printf("W[1]: "); printMatrix(getNetWeights(network, 1));
+    printf("b[1]: "); printVector(getLayerBias(getNetLayer(network, 1)));
     
     p = 0;
     while (p < 4) {
@@ -108,6 +115,95 @@ void backpropXorDemo() {
 
 }
 
+void hogwildXorDemo() {
+    //The same 2-7-1 network as backpropXorDemo, trained lock-free on two threads.
+    int sizes[] = {2, 7, 1, 0};
+    NeuralNet network = makeNeuralNet(sizes);
+
+    int i = 2;
+    while (i--)
+        setLayerBias(getNetLayer(network, i), makeMatrix(sizes[i+1], 1));
+    packNetParams(network);
+
+    srand(time(NULL));
+
+    i = 4;
+    while (i--) {
+        Matrix M = i < 2 ? getNetWeights(network, i) : getLayerBias(getNetLayer(network, i - 2));
+        int k = M->ROWS * M->COLS;
+        while (k--)
+            M->vals[k] = 2 * ((double) rand()) / ((double) RAND_MAX) - 1;
+    }
+
+    NetTrainKit kit = makeNetTrainKit();
+    kit->functions = (TransFunc*) malloc(2 * sizeof(TransFunc));
+    kit->functions[0] = sigmoidTransfer;
+    kit->functions[1] = linearTransfer;
+    kit->derivatives = (TransFunc*) malloc(2 * sizeof(TransFunc));
+    kit->derivatives[0] = sigmoidTransferGradient;
+    kit->derivatives[1] = linearTransferGradient;
+
+    setLayerFunc(getNetLayer(network, 0), kit->functions[0]);
+    setLayerFunc(getNetLayer(network, 1), kit->functions[1]);
+
+    kit->learnRate = 0.01;
+    kit->momentum = 0.05;
+    kit->maxCycles = 65536;
+    kit->threads = 2;
+    kit->hogwild = 1;
+
+    //Hogwild only runs on sparse inputs, so each input also lists its ones.
+    kit->data = (Matrix**) malloc(5 * sizeof(Matrix*));
+    kit->data[4] = NULL;
+    kit->sparseInputs = (SparseVector*) malloc(4 * sizeof(SparseVector));
+
+    int p = 4;
+    while (p--) {
+        int idx[2];
+        int nnz = 0;
+        if (p / 2)
+            idx[nnz++] = 0;
+        if (p % 2)
+            idx[nnz++] = 1;
+        kit->sparseInputs[p] = makeSparseVector(2, nnz, idx, NULL);
+
+        kit->data[p] = (Matrix*) malloc(2 * sizeof(Matrix));
+        kit->data[p][0] = sparseVecToDense(kit->sparseInputs[p]);
+        kit->data[p][1] = makeMatrix(1, 1);
+        setMtrxVal(kit->data[p][1], 0, 0, (p / 2) ^ (p % 2));
+    }
+
+    printf("Training on %i threads without locks...\n", kit->threads);
+    backpropagationTrain(network, kit);
+
+    double maxErr = 0;
+    p = 0;
+    while (p < 4) {
+        Matrix res = netFunction(network, kit->data[p][0]);
+        double e = fabs(getMtrxVal(res, 0, 0) - getMtrxVal(kit->data[p][1], 0, 0));
+        if (e > maxErr)
+            maxErr = e;
+        printf("%i XOR %i = %lf\n", p/2, p%2, getMtrxVal(res, 0, 0));
+        freeMatrix(res);
+        p++;
+    }
+    printf("Hogwild training %s (largest error %lf)\n", maxErr < 0.1 ? "converged" : "did not converge", maxErr);
+
+    p = 4;
+    while (p--) {
+        freeSparseVector(kit->sparseInputs[p]);
+        freeMatrix(kit->data[p][0]);
+        freeMatrix(kit->data[p][1]);
+        free(kit->data[p]);
+    }
+    free(kit->sparseInputs);
+    free(kit->data);
+    free(kit->functions);
+    free(kit->derivatives);
+    free(kit);
+    freeNeuralNet(network);
+}
+
 void hebbianXODemo() {
     //We will say that images are drawn on a 5x5 canvas. This requires a net with 25 inputs.
 
@@ -126,7 +222,7 @@ void hebbianXODemo() {
 
     //In order to train, we need a training kit.
     printf("Allocating training kit...\n");
-    NetTrainKit kit = (NetTrainKit) malloc(sizeof(struct nettrainkit));
+    NetTrainKit kit = makeNetTrainKit();
     
     //We might need to have the transfer functions and their derivatives.
     printf("Building training kit...\n");
@@ -210,7 +306,7 @@ void deltaOrGateDemo() {
 
     //In order to train, we need a training kit.
     printf("Allocating training kit...\n");
-    NetTrainKit kit = (NetTrainKit) malloc(sizeof(struct nettrainkit));
+    NetTrainKit kit = makeNetTrainKit();
     
     //We might need to have the transfer functions and their derivatives.
     printf("Building training kit...\n");
@@ -220,8 +316,9 @@ void deltaOrGateDemo() {
     *(kit->derivatives) = sigmoidTransferGradient;
 
     //We also need a learning rate, as well as a maximum number of cycles.
-    kit->learnRate = 0.0625; //Set the learn rate coefficient to 0.0625.
-    kit->maxCycles = 64; //Max 64 cycles.
+    //The sigmoid's gradient is at most 1/4, so the rate is large to make up for it.
+    kit->learnRate = 4; //Set the learn rate coefficient to 4.
+    kit->maxCycles = 256; //Max 256 cycles.
     kit->decay = 0;
 
     //We will also need training data.
@@ -302,7 +399,7 @@ void hebbianBananaDemo() {
 
     //In order to train, we need a training kit.
     printf("Allocating training kit...\n");
-    NetTrainKit kit = (NetTrainKit) malloc(sizeof(struct nettrainkit));
+    NetTrainKit kit = makeNetTrainKit();
     
     //We might need to have the transfer functions and their derivatives.
     printf("Building training kit...\n");
@@ -376,3 +473,58 @@ void hebbianBananaDemo() {
 
 
 
+
+static double demoSeconds(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void fastSigmoidDemo() {
+    //Sweep a range wider than the table covers, so clamping is measured too.
+    int n = 1 << 16;
+    Matrix x = makeMatrix(n, 1);
+    int i = n;
+    while (i--)
+        setMtrxVal(x, i, 0, 40.0 * i / n - 20);
+
+    Matrix exact = sigmoidTransfer(x);
+    Matrix fast = fastSigmoidTransfer(x);
+
+    double maxErr = 0;
+    i = n;
+    while (i--) {
+        double e = fabs(getMtrxVal(exact, i, 0) - getMtrxVal(fast, i, 0));
+        if (e > maxErr)
+            maxErr = e;
+    }
+    printf("Max error of fastSigmoidTransfer: %e\n", maxErr);
+
+    //Time the in-place versions so only the function itself is measured.
+    int reps = 256;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    i = reps;
+    while (i--) {
+        copyMtrxInto(exact, x);
+        sigmoidTransferInPlace(exact);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double exactTime = demoSeconds(start, end);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    i = reps;
+    while (i--) {
+        copyMtrxInto(fast, x);
+        fastSigmoidTransferInPlace(fast);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double fastTime = demoSeconds(start, end);
+
+    printf("sigmoidTransfer:     %lf ns per value\n", exactTime * 1e9 / reps / n);
+    printf("fastSigmoidTransfer: %lf ns per value (%.2lfx)\n",
+            fastTime * 1e9 / reps / n, exactTime / fastTime);
+
+    freeMatrix(x);
+    freeMatrix(exact);
+    freeMatrix(fast);
+}
@@ -1,45 +1,133 @@
 #include "neuralnet.h"
 
 #include <math.h>
+#include <pthread.h>
+#include <string.h>
 
-Matrix unitStepTransfer(Matrix m) {
-    Matrix u = makeMatrix(m->ROWS, 1);
+/* Doubles per SIMD register on the target. */
+#if defined(__AVX__)
+#define TRANSFER_VW 4
+#else
+#define TRANSFER_VW 2
+#endif
+
+#if defined(__GNUC__)
+typedef double transfer_vec __attribute__((vector_size(TRANSFER_VW * sizeof(double))));
+typedef long long transfer_ivec __attribute__((vector_size(TRANSFER_VW * sizeof(double))));
+typedef unsigned long long transfer_uvec __attribute__((vector_size(TRANSFER_VW * sizeof(double))));
+
+/* 2^(j/64) for j = 0 to 63, correctly rounded. */
+static const double exp2Table[64] = {
+    0x1.0000000000000p+0, 0x1.02c9a3e778061p+0,
+    0x1.059b0d3158574p+0, 0x1.0874518759bc8p+0,
+    0x1.0b5586cf9890fp+0, 0x1.0e3ec32d3d1a2p+0,
+    0x1.11301d0125b51p+0, 0x1.1429aaea92de0p+0,
+    0x1.172b83c7d517bp+0, 0x1.1a35beb6fcb75p+0,
+    0x1.1d4873168b9aap+0, 0x1.2063b88628cd6p+0,
+    0x1.2387a6e756238p+0, 0x1.26b4565e27cddp+0,
+    0x1.29e9df51fdee1p+0, 0x1.2d285a6e4030bp+0,
+    0x1.306fe0a31b715p+0, 0x1.33c08b26416ffp+0,
+    0x1.371a7373aa9cbp+0, 0x1.3a7db34e59ff7p+0,
+    0x1.3dea64c123422p+0, 0x1.4160a21f72e2ap+0,
+    0x1.44e086061892dp+0, 0x1.486a2b5c13cd0p+0,
+    0x1.4bfdad5362a27p+0, 0x1.4f9b2769d2ca7p+0,
+    0x1.5342b569d4f82p+0, 0x1.56f4736b527dap+0,
+    0x1.5ab07dd485429p+0, 0x1.5e76f15ad2148p+0,
+    0x1.6247eb03a5585p+0, 0x1.6623882552225p+0,
+    0x1.6a09e667f3bcdp+0, 0x1.6dfb23c651a2fp+0,
+    0x1.71f75e8ec5f74p+0, 0x1.75feb564267c9p+0,
+    0x1.7a11473eb0187p+0, 0x1.7e2f336cf4e62p+0,
+    0x1.82589994cce13p+0, 0x1.868d99b4492edp+0,
+    0x1.8ace5422aa0dbp+0, 0x1.8f1ae99157736p+0,
+    0x1.93737b0cdc5e5p+0, 0x1.97d829fde4e50p+0,
+    0x1.9c49182a3f090p+0, 0x1.a0c667b5de565p+0,
+    0x1.a5503b23e255dp+0, 0x1.a9e6b5579fdbfp+0,
+    0x1.ae89f995ad3adp+0, 0x1.b33a2b84f15fbp+0,
+    0x1.b7f76f2fb5e47p+0, 0x1.bcc1e904bc1d2p+0,
+    0x1.c199bdd85529cp+0, 0x1.c67f12e57d14bp+0,
+    0x1.cb720dcef9069p+0, 0x1.d072d4a07897cp+0,
+    0x1.d5818dcfba487p+0, 0x1.da9e603db3285p+0,
+    0x1.dfc97337b9b5fp+0, 0x1.e502ee78b3ff6p+0,
+    0x1.ea4afa2a490dap+0, 0x1.efa1bee615a27p+0,
+    0x1.f50765b6e4540p+0, 0x1.fa7c1819e90d8p+0
+};
+
+/**
+ * e^x for every lane, to within a few ulp of exp(). The argument is split
+ * as x = (64m + j) ln(2) / 64 + r with |r| <= ln(2) / 128, so that
+ * e^x = 2^m 2^(j/64) e^r. The middle factor comes from a table, e^r from a
+ * short Taylor series, and 2^m is added straight into the exponent bits.
+ * Inputs are clamped to the range where the result is a normal double.
+ */
+static transfer_vec vecExp(transfer_vec x) {
+    const transfer_vec hi = (transfer_vec) {0} + 709;
+    const transfer_vec lo = (transfer_vec) {0} - 708;
+    x = (transfer_vec) (((transfer_ivec) x & ~(x > hi)) | ((transfer_ivec) hi & (x > hi)));
+    x = (transfer_vec) (((transfer_ivec) x & ~(x < lo)) | ((transfer_ivec) lo & (x < lo)));
+
+    //Adding and subtracting 1.5 * 2^52 rounds to the nearest integer, which
+    //is also left in the low bits of the sum.
+    const transfer_vec shift = (transfer_vec) {0} + 6755399441055744.0;
+    transfer_vec t = x * (64 / 6.93147180559945309417e-01) + shift;
+    transfer_vec k = t - shift;
+    transfer_ivec n = (transfer_ivec) t - (transfer_ivec) shift;
+
+    transfer_vec r = x - k * (6.93147180369123816490e-01 / 64);
+    r = r - k * (1.90821492927058770002e-10 / 64);
+
+    transfer_vec p = r * r * (0.5 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120)))) + r;
+
+    transfer_vec T;
+    int l = TRANSFER_VW;
+    while (l--)
+        T[l] = exp2Table[n[l] & 63];
+
+    //Scale the table entry by 2^m, then multiply in e^r = 1 + p. The bias
+    //keeps m + 1023 positive so it can be found with a logical shift.
+    transfer_uvec m = ((transfer_uvec) (n + 1023 * 64) >> 6) - 1023;
+    T = (transfer_vec) ((transfer_uvec) T + (m << 52));
+    return T + T * p;
+}
+#endif
 
-    int r = m->ROWS;
-    while (r--) {
-        double d = getMtrxVal(m, r, 0);
-        setMtrxVal(u, r, 0, d >= 0 ? 1 : 0);
+/* Applies 1 / (1 + e^(-x)) to n doubles in place. */
+static void sigmoidArray(double *v, int n) {
+#if defined(__GNUC__)
+    int i = 0;
+    while (i + TRANSFER_VW <= n) {
+        transfer_vec x;
+        memcpy(&x, v + i, sizeof(x));
+        x = 1 / (1 + vecExp(-x));
+        memcpy(v + i, &x, sizeof(x));
+        i += TRANSFER_VW;
     }
 
+    if (i < n) {
+        transfer_vec x = {0};
+        memcpy(&x, v + i, (n - i) * sizeof(double));
+        x = 1 / (1 + vecExp(-x));
+        memcpy(v + i, &x, (n - i) * sizeof(double));
+    }
+#else
+    while (n--)
+        v[n] = 1.0 / (1 + exp(-v[n]));
+#endif
+}
+
+Matrix unitStepTransfer(Matrix m) {
+    Matrix u = cloneMatrix(m);
+    unitStepTransferInPlace(u);
     return u;
 }
 
 Matrix competeTransfer(Matrix m) {
-    //A small, negative constant.
-
     Matrix y = cloneMatrix(m);
-    int max = m->ROWS - 1;
-    double maxVal = getMtrxVal(m, max, 0);
-
-    int i = max;
-    while (i--) {
-        double a = getMtrxVal(y, i, 0);
-        if (a >= maxVal) {
-            setMtrxVal(y, max, 0, 0);
-            max = i;
-            maxVal = a;
-        } else {
-            setMtrxVal(y, i, 0, 0);
-        }
-    }
-
-    setMtrxVal(y, max, 0, 0);
-    
+    competeTransferInPlace(y);
     return y;
 }
 
 Matrix zeroMatrix(Matrix m) {
-    return makeMatrix(m->ROWS, m->ROWS);
+    return makeMatrix(m->ROWS, m->COLS);
 }
 
 Matrix linearTransfer(Matrix m) {
@@ -47,41 +135,176 @@ Matrix linearTransfer(Matrix m) {
 }
 
 Matrix linearTransferGradient(Matrix m) {
-    Matrix g = makeMatrix(m->ROWS, m->ROWS);
-    int r = m->ROWS;
-    while (r--) {
-        setMtrxVal(g, r, r, 1);
-    }
+    Matrix g = makeMatrix(m->ROWS, m->COLS);
+    int i = m->ROWS * m->COLS;
+    while (i--)
+        g->vals[i] = 1;
 
     return g;
 }
 
 Matrix sigmoidTransfer(Matrix m) {
-    Matrix sig = makeMatrix(m->ROWS, m->COLS);
-    int r = 0;
-    while(r < m->ROWS) {
-        int c = 0;
-        while(c < m->COLS) {
-            double d = getMtrxVal(m, r, c);
-            setMtrxVal(sig, r, c, 1.0 / (1 + exp(-d)));
-            c++;
-        }
-        r++;
-    }
-
+    Matrix sig = cloneMatrix(m);
+    sigmoidTransferInPlace(sig);
     return sig;
 }
 
 Matrix sigmoidTransferGradient(Matrix m) {
-    Matrix g = makeMatrix(m->ROWS, m->ROWS);
-    int r = 0;
-    while(r < m->ROWS) {
-        double d = getMtrxVal(m, r, r);
-        d = 1.0 / (1 + exp(-d));
-        setMtrxVal(g, r, 0, d * (1 - d));
-        r++;
+    Matrix g = cloneMatrix(m);
+    int n = m->ROWS * m->COLS;
+    sigmoidArray(g->vals, n);
+
+    int i = 0;
+    while (i < n) {
+        g->vals[i] *= 1 - g->vals[i];
+        i++;
     }
 
     return g;
 }
 
+/* The approximate sigmoid interpolates a table with this many steps per unit
+   over [-FAST_SIGMOID_RANGE, FAST_SIGMOID_RANGE], and clamps beyond it. */
+#define FAST_SIGMOID_STEPS 32
+#define FAST_SIGMOID_RANGE 16
+#define FAST_SIGMOID_SIZE (2 * FAST_SIGMOID_RANGE * FAST_SIGMOID_STEPS + 2)
+
+static double fastSigmoidTable[FAST_SIGMOID_SIZE];
+static pthread_once_t fastSigmoidOnce = PTHREAD_ONCE_INIT;
+
+static void makeFastSigmoidTable() {
+    int i = FAST_SIGMOID_SIZE;
+    while (i--) {
+        double x = (double) i / FAST_SIGMOID_STEPS - FAST_SIGMOID_RANGE;
+        fastSigmoidTable[i] = 1.0 / (1 + exp(-x));
+    }
+}
+
+Matrix fastSigmoidTransfer(Matrix m) {
+    Matrix sig = cloneMatrix(m);
+    fastSigmoidTransferInPlace(sig);
+    return sig;
+}
+
+void linearTransferInPlace(Matrix m) {
+}
+
+void fastSigmoidTransferInPlace(Matrix m) {
+    pthread_once(&fastSigmoidOnce, makeFastSigmoidTable);
+
+    int n = m->ROWS * m->COLS;
+    int i = 0;
+    while (i < n) {
+        double x = m->vals[i];
+
+        //A NaN would pass the clamp and index anywhere; it stays NaN, as in sigmoidTransfer.
+        if (x != x) {
+            i++;
+            continue;
+        }
+        x = x > FAST_SIGMOID_RANGE ? FAST_SIGMOID_RANGE : x < -FAST_SIGMOID_RANGE ? -FAST_SIGMOID_RANGE : x;
+
+        //Position in the table, split into an entry and the fraction past it.
+        double t = (x + FAST_SIGMOID_RANGE) * FAST_SIGMOID_STEPS;
+        int k = (int) t;
+        double f = t - k;
+
+        m->vals[i] = fastSigmoidTable[k] + f * (fastSigmoidTable[k+1] - fastSigmoidTable[k]);
+        i++;
+    }
+}
+
+void sigmoidTransferInPlace(Matrix m) {
+    sigmoidArray(m->vals, m->ROWS * m->COLS);
+}
+
+void unitStepTransferInPlace(Matrix m) {
+    //A forward loop with a plain select, so the compiler can vectorize it.
+    int n = m->ROWS * m->COLS;
+    int i = 0;
+    while (i < n) {
+        m->vals[i] = m->vals[i] >= 0 ? 1 : 0;
+        i++;
+    }
+}
+
+void competeTransferInPlace(Matrix m) {
+    //Each column is a separate input; the first of its largest entries wins.
+    int c = m->COLS;
+    while (c--) {
+        int max = m->ROWS - 1;
+        double maxVal = getMtrxVal(m, max, c);
+
+        int i = max;
+        while (i--) {
+            double a = getMtrxVal(m, i, c);
+            if (a >= maxVal) {
+                max = i;
+                maxVal = a;
+            }
+        }
+
+        i = m->ROWS;
+        while (i--)
+            setMtrxVal(m, i, c, i == max ? 1 : 0);
+    }
+}
+
+TransFuncInPlace getInPlaceTransfer(TransFunc f) {
+    if (f == linearTransfer)
+        return linearTransferInPlace;
+    if (f == sigmoidTransfer)
+        return sigmoidTransferInPlace;
+    if (f == fastSigmoidTransfer)
+        return fastSigmoidTransferInPlace;
+    if (f == unitStepTransfer)
+        return unitStepTransferInPlace;
+    if (f == competeTransfer)
+        return competeTransferInPlace;
+
+    return NULL;
+}
+
+void linearGradientFromOutput(Matrix d, Matrix y) {
+}
+
+void sigmoidGradientFromOutput(Matrix d, Matrix y) {
+    int n = d->ROWS * d->COLS;
+    int i = 0;
+    while (i < n) {
+        d->vals[i] *= y->vals[i] * (1 - y->vals[i]);
+        i++;
+    }
+}
+
+TransGradFromOutput getOutputGradient(TransFunc f, TransFunc g) {
+    if (g == linearTransferGradient)
+        return linearGradientFromOutput;
+    if ((f == sigmoidTransfer || f == fastSigmoidTransfer) && g == sigmoidTransferGradient)
+        return sigmoidGradientFromOutput;
+
+    return NULL;
+}
+
+/* Indexed by transfer ID; the order is part of the model file format. */
+static const TransFunc transferIds[TRANSFER_ID_MAX + 1] = {
+    NULL,
+    linearTransfer,
+    sigmoidTransfer,
+    unitStepTransfer,
+    competeTransfer,
+    fastSigmoidTransfer
+};
+
+int getTransferId(TransFunc f) {
+    int i = TRANSFER_ID_MAX + 1;
+    while (i--)
+        if (transferIds[i] == f)
+            return i;
+
+    return -1;
+}
+
+TransFunc getTransferById(int id) {
+    return id >= 0 && id <= TRANSFER_ID_MAX ? transferIds[id] : NULL;
+}